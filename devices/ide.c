@@ -1,6 +1,8 @@
 #include "devices/ide.h"
 #include <ctype.h>
 #include <debug.h>
+#include <list.h>
+#include <round.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include "devices/block.h"
@@ -8,7 +10,10 @@
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -34,6 +39,50 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
+
+/* Bus master IDE port addresses, relative to the base port
+   found in BAR4 of the IDE controller's PCI configuration
+   space.  Each channel has its own set of 8 ports. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0)  /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)   /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)     /* PRD table. */
+
+/* Bus Master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start/stop transfer. */
+#define BM_CMD_READ 0x08        /* Transfer direction: 1=to memory. */
+
+/* Bus Master Status Register bits. */
+#define BM_STA_ACTIVE 0x01      /* Transfer in progress. */
+#define BM_STA_ERR 0x02         /* Error (write 1 to clear). */
+#define BM_STA_INTR 0x04        /* Interrupt (write 1 to clear). */
+#define BM_STA_DMA0 0x20        /* Device 0 is DMA capable. */
+#define BM_STA_DMA1 0x40        /* Device 1 is DMA capable. */
+
+/* A Physical Region Descriptor: one physically contiguous
+   region of memory taking part in a bus master transfer.  The
+   region may not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical base address. */
+    uint16_t size;              /* Byte count, 0 means 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last entry. */
+  };
+#define PRD_EOT 0x8000          /* End of table. */
+
+/* PCI configuration space access ports. */
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/* PCI configuration space registers and values of interest. */
+#define PCI_REG_ID 0x00         /* Device ID:Vendor ID. */
+#define PCI_REG_COMMAND 0x04    /* Command register (low 16 bits). */
+#define PCI_REG_CLASS 0x08      /* Class:Subclass:Prog IF:Revision. */
+#define PCI_REG_BAR4 0x20       /* Base address register 4. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_MASTER 0x0004   /* Enable bus mastering. */
+#define PCI_CLASS_IDE 0x0101    /* Mass storage, IDE controller. */
+#define PCI_PROGIF_MASTER 0x80  /* IDE controller can bus master. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +98,12 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Maximum number of sectors transferred by one command.  The
+   Sector Count register holds 0 to mean 256. */
+#define MAX_SECTORS_PER_CMD 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +112,7 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    bool use_dma;               /* Transfer with bus master DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -67,14 +123,45 @@ struct channel
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
 
-    struct lock lock;           /* Must acquire to access the controller. */
+    struct lock lock;           /* Protects the request queue. */
+    struct condition queue_nonempty;    /* Signaled on new request. */
+    struct list queue;          /* Pending requests, oldest first. */
+    block_sector_t head_pos;    /* Sector after the last transfer. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base I/O port, or 0 if
+                                   the channel cannot do DMA. */
+    struct prd *prdt;           /* PRD table, in its own page. */
+    bool dma_active;            /* True while a DMA transfer runs. */
+    bool dma_failed;            /* Set by interrupt handler on error. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
+/* A request to transfer contiguous sectors of a disk.  Requests
+   are queued on the disk's channel and performed by the
+   channel's I/O thread, which may merge requests for adjacent
+   sectors into a single command. */
+struct ide_request
+  {
+    struct list_elem elem;      /* Element in channel queue or batch. */
+    struct ata_disk *disk;      /* Disk to transfer to or from. */
+    block_sector_t sector;      /* First sector. */
+    size_t cnt;                 /* Number of sectors. */
+    uint8_t *buffer;            /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                 /* Write to disk or read from it? */
+    int64_t deadline;           /* Tick by which to serve the request. */
+    void (*complete) (struct ide_request *);  /* Called when done. */
+    void *aux;                  /* For use by COMPLETE. */
+  };
+
+/* Number of timer ticks that a request may wait in a channel's
+   queue before it is served ahead of requests in elevator
+   order. */
+#define IDE_DEADLINE (TIMER_FREQ / 2)
+
 /* We support the two "legacy" ATA channels found in a standard PC. */
 #define CHANNEL_CNT 2
 static struct channel channels[CHANNEL_CNT];
@@ -85,8 +172,11 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
+static uint16_t find_bus_master (void);
+static void dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          struct list *batch, bool write);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
 
@@ -96,11 +186,13 @@ static void select_device (const struct ata_disk *);
 static void select_device_wait (const struct ata_disk *);
 
 static void interrupt_handler (struct intr_frame *);
+static thread_func channel_io NO_RETURN;
 
 /* Initialize the disk subsystem and detect disks. */
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -124,8 +216,23 @@ ide_init (void)
           NOT_REACHED ();
         }
       lock_init (&c->lock);
+      cond_init (&c->queue_nonempty);
+      list_init (&c->queue);
+      c->head_pos = 0;
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = 0;
+      c->prdt = NULL;
+      c->dma_active = false;
+      c->dma_failed = false;
+
+      /* Set up bus master DMA, if the controller supports it. */
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + chan_no * 8;
+        }
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,11 +243,16 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->use_dma = false;
         }
 
       /* Register interrupt handler. */
       intr_register_ext (c->irq, interrupt_handler, c->name);
 
+      /* Start I/O thread. */
+      if (thread_create (c->name, PRI_MAX, channel_io, c) == TID_ERROR)
+        PANIC ("%s: failed to start I/O thread", c->name);
+
       /* Reset hardware. */
       reset_channel (c);
 
@@ -281,6 +393,16 @@ identify_ata_device (struct ata_disk *d)
     }
   input_sector (c, id);
 
+  /* Use DMA if both the controller and the disk support it,
+     as reported by bit 8 of word 49 of the identity data.
+     Tell the controller the disk is DMA capable. */
+  if (c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100) != 0)
+    {
+      d->use_dma = true;
+      outb (reg_bm_status (c), inb (reg_bm_status (c))
+            | (d->dev_no == 0 ? BM_STA_DMA0 : BM_STA_DMA1));
+    }
+
   /* Calculate capacity.
      Read model name and serial number. */
   capacity = *(uint32_t *) &id[60 * 2];
@@ -337,6 +459,94 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
+/* Queues REQ, a transfer of REQ->CNT contiguous sectors of
+   REQ->DISK, and returns without waiting for it.  REQ->COMPLETE
+   is called from the channel's I/O thread, with REQ as argument,
+   once the transfer is done. */
+static void
+ide_submit (struct ide_request *req)
+{
+  struct channel *c = req->disk->channel;
+
+  ASSERT (req->cnt > 0 && req->cnt <= MAX_SECTORS_PER_CMD);
+
+  req->deadline = timer_ticks () + IDE_DEADLINE;
+  lock_acquire (&c->lock);
+  list_push_back (&c->queue, &req->elem);
+  cond_signal (&c->queue_nonempty, &c->lock);
+  lock_release (&c->lock);
+}
+
+/* Completion function for the requests of ide_transfer().
+   Ups the semaphore that the submitter waits on. */
+static void
+ide_complete_wakeup (struct ide_request *req)
+{
+  sema_up (req->aux);
+}
+
+/* Transfers CNT contiguous sectors starting at SEC_NO between
+   disk D and BUFFER, to the disk if WRITE is true and from it
+   otherwise, and waits until the transfer is done.  The
+   transfer is submitted as one request per MAX_SECTORS_PER_CMD
+   sectors. */
+static void
+ide_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void *buffer, bool write)
+{
+  struct ide_request reqs[DIV_ROUND_UP (cnt, MAX_SECTORS_PER_CMD)];
+  struct semaphore done;
+  uint8_t *p = buffer;
+  size_t req_cnt = 0;
+  size_t i;
+
+  sema_init (&done, 0);
+  while (cnt > 0)
+    {
+      struct ide_request *req = &reqs[req_cnt++];
+      size_t chunk = cnt < MAX_SECTORS_PER_CMD ? cnt : MAX_SECTORS_PER_CMD;
+
+      req->disk = d;
+      req->sector = sec_no;
+      req->cnt = chunk;
+      req->buffer = p;
+      req->write = write;
+      req->complete = ide_complete_wakeup;
+      req->aux = &done;
+      ide_submit (req);
+
+      p += chunk * BLOCK_SECTOR_SIZE;
+      sec_no += chunk;
+      cnt -= chunk;
+    }
+  for (i = 0; i < req_cnt; i++)
+    sema_down (&done);
+}
+
+/* Reads CNT contiguous sectors starting at SEC_NO from disk D
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                   void *buffer)
+{
+  ide_transfer (d_, sec_no, cnt, buffer, false);
+}
+
+/* Writes CNT contiguous sectors starting at SEC_NO to disk D
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the disk has acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *buffer)
+{
+  ide_transfer (d_, sec_no, cnt, (void *) buffer, true);
+}
+
 /* Reads sector SEC_NO from disk D into BUFFER, which must have
    room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to disks, so external
@@ -344,16 +554,7 @@ descramble_ata_string (char *string, int size)
 static void
 ide_read (void *d_, block_sector_t sec_no, void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  ide_read_multiple (d_, sec_no, 1, buffer);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -364,36 +565,30 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
 static void
 ide_write (void *d_, block_sector_t sec_no, const void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  ide_write_multiple (d_, sec_no, 1, buffer);
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the count CNT of sectors to transfer to the
+   disk's sector selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_CMD);
+  ASSERT (sec_no + cnt <= (1UL << 28));
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_SECTORS_PER_CMD ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -414,6 +609,293 @@ issue_pio_command (struct channel *c, uint8_t command)
   outb (reg_command (c), command);
 }
 
+/* Bus master DMA. */
+
+/* Reads and returns the 32-bit register REG from the PCI
+   configuration space of function FUNC of device DEV on BUS. */
+static uint32_t
+pci_read_config (int bus, int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDR, 0x80000000 | (bus << 16) | (dev << 11)
+                         | (func << 8) | (reg & 0xfc));
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes DATA to the 32-bit register REG in the PCI
+   configuration space of function FUNC of device DEV on BUS. */
+static void
+pci_write_config (int bus, int dev, int func, int reg, uint32_t data)
+{
+  outl (PCI_CONFIG_ADDR, 0x80000000 | (bus << 16) | (dev << 11)
+                         | (func << 8) | (reg & 0xfc));
+  outl (PCI_CONFIG_DATA, data);
+}
+
+/* Scans PCI bus 0 for an IDE controller capable of bus master
+   DMA, such as the PIIX3 that QEMU emulates, and enables bus
+   mastering on it.  Returns the base I/O port of its bus master
+   registers, or 0 if there is no such controller, in which case
+   the disks are accessed with PIO only. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class, bar4, command;
+
+        if ((pci_read_config (0, dev, func, PCI_REG_ID) & 0xffff) == 0xffff)
+          {
+            if (func == 0)
+              break;
+            continue;
+          }
+
+        class = pci_read_config (0, dev, func, PCI_REG_CLASS);
+        if ((class >> 16) != PCI_CLASS_IDE
+            || ((class >> 8) & PCI_PROGIF_MASTER) == 0)
+          continue;
+
+        /* BAR4 must be an I/O space base address. */
+        bar4 = pci_read_config (0, dev, func, PCI_REG_BAR4);
+        if ((bar4 & 1) == 0 || (bar4 & 0xfffc) == 0)
+          continue;
+
+        command = pci_read_config (0, dev, func, PCI_REG_COMMAND);
+        pci_write_config (0, dev, func, PCI_REG_COMMAND,
+                          command | PCI_CMD_IO | PCI_CMD_MASTER);
+        return bar4 & 0xfffc;
+      }
+
+  return 0;
+}
+
+/* Transfers the CNT contiguous sectors starting at SEC_NO
+   covered by the requests in BATCH, in order, between disk D and
+   the requests' buffers with a single bus master DMA command, to
+   the disk if WRITE is true and from it otherwise.
+
+   The buffers must be in kernel virtual memory.  Each one is
+   described to the controller as one PRD per page it spans,
+   since each PRD must be physically contiguous and may not cross
+   a 64 kB boundary.  The interrupt handler stops the transfer
+   when the disk signals completion. */
+static void
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              struct list *batch, bool write)
+{
+  struct channel *c = d->channel;
+  struct prd *prd = c->prdt;
+  struct list_elem *e;
+
+  /* Build PRD table. */
+  for (e = list_begin (batch); e != list_end (batch); e = list_next (e))
+    {
+      struct ide_request *req = list_entry (e, struct ide_request, elem);
+      uint8_t *p = req->buffer;
+      size_t left = req->cnt * BLOCK_SECTOR_SIZE;
+
+      ASSERT (is_kernel_vaddr (p));
+      while (left > 0)
+        {
+          size_t size = PGSIZE - pg_ofs (p);
+          if (size > left)
+            size = left;
+
+          ASSERT (prd < c->prdt + PGSIZE / sizeof *prd);
+          prd->addr = vtop (p);
+          prd->size = size;
+          prd->flags = 0;
+          prd++;
+
+          p += size;
+          left -= size;
+        }
+    }
+  prd[-1].flags = PRD_EOT;
+
+  /* Program the bus master and clear its stale status bits. */
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), write ? 0 : BM_CMD_READ);
+  outb (reg_bm_status (c),
+        inb (reg_bm_status (c)) | BM_STA_ERR | BM_STA_INTR);
+
+  /* Issue the command to the disk, then start the transfer. */
+  select_sector (d, sec_no, cnt);
+  c->dma_active = true;
+  c->dma_failed = false;
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+  sema_down (&c->completion_wait);
+
+  if (c->dma_failed)
+    PANIC ("%s: disk %s failed, sector=%"PRDSNu,
+           d->name, write ? "write" : "read", sec_no);
+}
+
+/* Transfers the CNT contiguous sectors starting at SEC_NO
+   covered by the requests in BATCH, in order, between disk D and
+   the requests' buffers with a single PIO command, to the disk
+   if WRITE is true and from it otherwise.  The disk interrupts
+   once per sector, as its data becomes ready for a read or after
+   it has accepted the data for a write. */
+static void
+pio_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              struct list *batch, bool write)
+{
+  struct channel *c = d->channel;
+  struct list_elem *e;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, write ? CMD_WRITE_SECTOR_RETRY
+                              : CMD_READ_SECTOR_RETRY);
+  for (e = list_begin (batch); e != list_end (batch); e = list_next (e))
+    {
+      struct ide_request *req = list_entry (e, struct ide_request, elem);
+      size_t i;
+
+      for (i = 0; i < req->cnt; i++, sec_no++)
+        {
+          uint8_t *p = req->buffer + i * BLOCK_SECTOR_SIZE;
+          if (!write)
+            sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk %s failed, sector=%"PRDSNu,
+                   d->name, write ? "write" : "read", sec_no);
+          if (write)
+            {
+              output_sector (c, p);
+              sema_down (&c->completion_wait);
+            }
+          else
+            input_sector (c, p);
+        }
+    }
+}
+
+/* Request scheduling. */
+
+/* Removes and returns the request that channel C should serve
+   next.  Requests are served in C-LOOK order: the one with the
+   lowest sector at or beyond the end of the last transfer, or
+   the lowest sector overall once none is left beyond it.  But
+   if the oldest request has waited past its deadline, it is
+   served first, so that a stream of requests ahead of the head
+   cannot starve requests behind it. */
+static struct ide_request *
+elevator_next (struct channel *c)
+{
+  struct ide_request *oldest, *ahead = NULL, *lowest = NULL;
+  struct list_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+  ASSERT (!list_empty (&c->queue));
+
+  oldest = list_entry (list_front (&c->queue), struct ide_request, elem);
+  if (timer_ticks () >= oldest->deadline)
+    {
+      list_remove (&oldest->elem);
+      return oldest;
+    }
+
+  for (e = list_begin (&c->queue); e != list_end (&c->queue);
+       e = list_next (e))
+    {
+      struct ide_request *req = list_entry (e, struct ide_request, elem);
+      if (req->sector >= c->head_pos
+          && (ahead == NULL || req->sector < ahead->sector))
+        ahead = req;
+      if (lowest == NULL || req->sector < lowest->sector)
+        lowest = req;
+    }
+
+  if (ahead == NULL)
+    ahead = lowest;
+  list_remove (&ahead->elem);
+  return ahead;
+}
+
+/* Moves the requests in channel C's queue that continue the
+   transfer of the requests in BATCH, which cover the CNT
+   sectors starting at SEC_NO, to the end of BATCH, as long as
+   the whole transfer stays within one command.  Returns the
+   number of sectors covered by BATCH afterward. */
+static size_t
+elevator_merge (struct channel *c, struct list *batch,
+                block_sector_t sec_no, size_t cnt)
+{
+  struct ide_request *first =
+    list_entry (list_front (batch), struct ide_request, elem);
+  struct list_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+
+  e = list_begin (&c->queue);
+  while (e != list_end (&c->queue))
+    {
+      struct ide_request *req = list_entry (e, struct ide_request, elem);
+      if (req->disk == first->disk && req->write == first->write
+          && req->sector == sec_no + cnt
+          && cnt + req->cnt <= MAX_SECTORS_PER_CMD)
+        {
+          list_remove (&req->elem);
+          list_push_back (batch, &req->elem);
+          cnt += req->cnt;
+
+          /* A later request may continue this one. */
+          e = list_begin (&c->queue);
+        }
+      else
+        e = list_next (e);
+    }
+
+  return cnt;
+}
+
+/* Thread function for the I/O thread of channel C_.  Repeatedly
+   takes the next request from the channel's queue, together with
+   any queued requests it can be merged with, performs them as a
+   single transfer, and calls their completion functions. */
+static void
+channel_io (void *c_)
+{
+  struct channel *c = c_;
+
+  for (;;)
+    {
+      struct ide_request *req;
+      struct list batch;
+      block_sector_t sec_no;
+      size_t cnt;
+
+      lock_acquire (&c->lock);
+      while (list_empty (&c->queue))
+        cond_wait (&c->queue_nonempty, &c->lock);
+      req = elevator_next (c);
+      list_init (&batch);
+      list_push_back (&batch, &req->elem);
+      sec_no = req->sector;
+      cnt = elevator_merge (c, &batch, sec_no, req->cnt);
+      c->head_pos = sec_no + cnt;
+      lock_release (&c->lock);
+
+      if (req->disk->use_dma)
+        dma_transfer (req->disk, sec_no, cnt, &batch, req->write);
+      else
+        pio_transfer (req->disk, sec_no, cnt, &batch, req->write);
+
+      /* The completion function may free the request. */
+      while (!list_empty (&batch))
+        {
+          struct list_elem *e = list_pop_front (&batch);
+          req = list_entry (e, struct ide_request, elem);
+          req->complete (req);
+        }
+    }
+}
+
 /* Reads a sector from channel C's data register in PIO mode into
    SECTOR, which must have room for BLOCK_SECTOR_SIZE bytes. */
 static void
@@ -513,7 +995,19 @@ interrupt_handler (struct intr_frame *f)
       {
         if (c->expecting_interrupt) 
           {
-            inb (reg_status (c));               /* Acknowledge interrupt. */
+            /* Stop a finished DMA transfer and check for errors. */
+            if (c->dma_active)
+              {
+                uint8_t bm_status = inb (reg_bm_status (c));
+                outb (reg_bm_command (c), 0);
+                outb (reg_bm_status (c), bm_status | BM_STA_ERR | BM_STA_INTR);
+                c->dma_failed = (bm_status & BM_STA_ERR) != 0;
+                c->dma_active = false;
+                if ((inb (reg_status (c)) & STA_ERR) != 0)
+                  c->dma_failed = true;
+              }
+            else
+              inb (reg_status (c));             /* Acknowledge interrupt. */
             sema_up (&c->completion_wait);      /* Wake up waiter. */
           }
         else
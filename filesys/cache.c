@@ -1,81 +1,193 @@
 #include "filesys/cache.h"
 #include <bitmap.h>
+#include <round.h>
+#include <stdlib.h>
+#include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Maximum number of contiguous sectors moved by a single
+   read-ahead transfer. */
+#define CACHE_RUN_MAX (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Number of sectors that fit in the cache. Set at boot time
+   by cache_configure(), before cache_init() is called. */
+static size_t cache_size = CACHE_DEFAULT_SIZE;
 
 /* Base addresses for cache data structures. */
 static void *cache;
 static struct cache_entry *cache_metadata;
-static struct bitmap *cache_bitmap;
-
-/* Lock and condition variable for block eviction. */
-static struct lock eviction_lock;
-static struct condition eviction_cond;
-
-/* Clock hands for the eviction algorithm. */
-static struct cache_entry *lagging_hand;
-static struct cache_entry *leading_hand;
 
-/* A semaphore to signal the read-ahead worker thread. */
-static struct semaphore read_ahead_sema;
-
-/* List of block sectors to be pre-loaded into cache. */
-static struct list read_ahead_list;
+/* Independently locked partitions of the cache. */
+static struct cache_shard *shards;
+static size_t shard_cnt;
+
+/* Number of milliseconds between periodic flushes. Set at
+   boot time by cache_configure_flush(). */
+static unsigned flush_interval = CACHE_FLUSH_INTERVAL;
+
+/* A dirty block found by cache_flush(). */
+struct flush_slot
+  {
+    block_sector_t sector;      /* Sector number when found. */
+    size_t cache_idx;           /* Cache slot it was found in. */
+  };
+
+/* Serializes flushes, which share the dirty block list and
+   the buffer that runs of blocks are gathered into. */
+static struct lock flush_lock;
+static struct flush_slot *flush_slots;
+static void *flush_buffer;
+
+/* Ring buffer of block sectors to be pre-loaded into cache,
+   and the run of sectors the read-ahead worker thread is
+   loading. */
+static block_sector_t read_ahead_queue[READ_AHEAD_QUEUE_SIZE];
+static size_t read_ahead_head;
+static size_t read_ahead_cnt;
+static block_sector_t read_ahead_current;
+static size_t read_ahead_current_cnt;
+
+/* Page that the read-ahead worker thread reads runs of
+   sectors into before copying them to their cache slots. */
+static void *read_ahead_buffer;
+
+/* Lock on the read-ahead queue, and condition variable to
+   signal the read-ahead worker thread that it is non-empty. */
+static struct lock read_ahead_lock;
+static struct condition read_ahead_cond;
+
+/* Read-ahead statistics. */
+static long long read_ahead_queued_cnt;  /* # of sectors queued. */
+static long long read_ahead_hit_cnt;     /* # already in cache. */
+static long long read_ahead_drop_cnt;    /* # already queued or
+                                            dropped on full queue. */
 
 /* Thread functions for asynchronous read-ahead and
    periodic writes of dirty blocks back to disk. */
 static thread_func cache_read_ahead NO_RETURN;
 static thread_func cache_periodic_flush NO_RETURN;
 
-static void clock_advance (void);
-static size_t clock_find (void);
-static size_t cache_evict_block (void);
-static size_t cache_find_block (block_sector_t sector);
+static hash_hash_func cache_index_hash;
+static hash_less_func cache_index_less;
+
+static struct cache_shard *sector_to_shard (block_sector_t sector);
+static bool cache_contains (block_sector_t sector);
+static size_t cache_dirty_cnt (void);
+static void cache_clean (struct cache_entry *ce);
+static int flush_slot_compare (const void *a, const void *b);
+static bool read_ahead_queued (block_sector_t sector);
+static void cache_wake_waiters (struct cache_entry *ce);
+static void clock_advance (struct cache_shard *shard);
+static size_t clock_find (struct cache_shard *shard);
+static size_t cache_evict_block (struct cache_shard *shard);
+static size_t cache_find_block (struct cache_shard *shard,
+                                block_sector_t sector);
+static size_t cache_claim (block_sector_t sector, bool *present);
 static size_t cache_load (block_sector_t sector);
 
+/* Sets the number of sectors that the buffer cache holds to
+   SECTOR_CNT, rounded up to a whole number of pages. Must be
+   called before cache_init(). */
+void
+cache_configure (size_t sector_cnt)
+{
+  if (sector_cnt < CACHE_MIN_SIZE)
+    PANIC ("cache_configure: cache must hold at least %d sectors.",
+           CACHE_MIN_SIZE);
+
+  cache_size = ROUND_UP (sector_cnt, PGSIZE / BLOCK_SECTOR_SIZE);
+}
+
+/* Sets the number of milliseconds between periodic flushes of
+   dirty blocks to INTERVAL_MS. Must be called before
+   cache_init(). */
+void
+cache_configure_flush (unsigned interval_ms)
+{
+  if (interval_ms < CACHE_FLUSH_POLL)
+    PANIC ("cache_configure_flush: interval must be at least %d ms.",
+           CACHE_FLUSH_POLL);
+
+  flush_interval = interval_ms;
+}
+
 /* Initializes the buffer cache.
 
-   More specifically, allocates memory for cache, cache
-   metadata, and cache bitmap. Initializes the global
-   eviction_lock for the eviction algorithm and individual
-   rw_locks for each of the cache_entry structs. Spawns
-   two worker threads to handle asynchronous read-ahead
-   and periodic writes of dirty blocks back to disk. */
+   More specifically, allocates pages for cache and cache
+   metadata, sized by cache_size, and splits the slots
+   evenly among the shards, each with its own lock, sector
+   index, free-slot bitmap and clock hands. Initializes
+   individual rw_locks for each of the cache_entry structs.
+   Spawns two worker threads to handle asynchronous
+   read-ahead and periodic writes of dirty blocks back to
+   disk. */
 void
 cache_init (void)
 {
   /* Allocate memory. */
-  cache = malloc (BLOCK_SECTOR_SIZE * CACHE_SIZE);
-  cache_metadata = malloc (sizeof (struct cache_entry) * CACHE_SIZE);
-  cache_bitmap = bitmap_create (CACHE_SIZE);
-  if (cache == NULL || cache_metadata == NULL || cache_bitmap == NULL)
+  size_t cache_pages = DIV_ROUND_UP (cache_size * BLOCK_SECTOR_SIZE, PGSIZE);
+  size_t metadata_pages =
+    DIV_ROUND_UP (cache_size * sizeof (struct cache_entry), PGSIZE);
+  shard_cnt = cache_size / CACHE_SHARD_MIN_SIZE;
+  if (shard_cnt > CACHE_MAX_SHARDS)
+    shard_cnt = CACHE_MAX_SHARDS;
+  cache = palloc_get_multiple (0, cache_pages);
+  cache_metadata = palloc_get_multiple (0, metadata_pages);
+  shards = malloc (sizeof (struct cache_shard) * shard_cnt);
+  flush_slots = malloc (sizeof (struct flush_slot) * cache_size);
+  flush_buffer = palloc_get_multiple (0, DIV_ROUND_UP (CACHE_FLUSH_RUN_MAX
+                                                       * BLOCK_SECTOR_SIZE,
+                                                       PGSIZE));
+  if (cache == NULL || cache_metadata == NULL || shards == NULL
+      || flush_slots == NULL || flush_buffer == NULL)
     PANIC ("cache_init: failed memory allocation for cache data structures.");
+  lock_init (&flush_lock);
 
-  /* Initialize eviction_lock and eviction condition variable. */
-  lock_init (&eviction_lock);
-  cond_init (&eviction_cond);
-
-  /* Initialize fields for each cache_entry. */
-  for (size_t idx = 0; idx < CACHE_SIZE; idx++)
+  /* Initialize each shard and the cache_entry structs of the
+     slots it owns. */
+  for (size_t shard_idx = 0; shard_idx < shard_cnt; shard_idx++)
     {
-      struct cache_entry *ce = cache_metadata + idx;
-      ce->sector_idx = SECTOR_NOT_PRESENT;
-      ce->cache_idx = idx;
-      ce->dirty = false;
-      ce->accessed = false;
-      rw_lock_init (&ce->rw_lock);
-    }
+      struct cache_shard *shard = shards + shard_idx;
+      shard->base = shard_idx * cache_size / shard_cnt;
+      shard->size = (shard_idx + 1) * cache_size / shard_cnt - shard->base;
+      shard->free_map = bitmap_create (shard->size);
+      if (shard->free_map == NULL
+          || !hash_init (&shard->index, cache_index_hash,
+                         cache_index_less, NULL))
+        PANIC ("cache_init: failed memory allocation for cache shards.");
+      lock_init (&shard->lock);
+      cond_init (&shard->cond);
+      shard->dirty_cnt = 0;
+
+      for (size_t idx = shard->base; idx < shard->base + shard->size; idx++)
+        {
+          struct cache_entry *ce = cache_metadata + idx;
+          ce->sector_idx = SECTOR_NOT_PRESENT;
+          ce->cache_idx = idx;
+          ce->dirty = false;
+          ce->accessed = false;
+          ce->shard = shard;
+          ce->waiters = 0;
+          rw_lock_init (&ce->rw_lock);
+        }
 
-  /* Initialize clock hands for eviction algorithm. */
-  lagging_hand = cache_metadata;
-  leading_hand = cache_metadata + (CACHE_SIZE / 4);
+      /* Initialize clock hands for eviction algorithm. */
+      shard->lagging_hand = cache_metadata + shard->base;
+      shard->leading_hand = shard->lagging_hand + (shard->size / 4);
+    }
 
-  /* Initialize list and semaphore for read-ahead worker thread. */
-  list_init (&read_ahead_list);
-  sema_init (&read_ahead_sema, 0);
+  /* Initialize queue for read-ahead worker thread. */
+  read_ahead_buffer = palloc_get_page (0);
+  if (read_ahead_buffer == NULL)
+    PANIC ("cache_init: failed memory allocation for read-ahead buffer.");
+  lock_init (&read_ahead_lock);
+  cond_init (&read_ahead_cond);
 
   /* Spawn worker threads for read-ahead and cache flushes. */
   tid_t tid_read_ahead = thread_create ("read-ahead", PRI_DEFAULT,
@@ -86,6 +198,92 @@ cache_init (void)
     PANIC ("cache_init: failed to spawn cache worker threads.");
 }
 
+/* Returns a hash of the sector number of the block held in
+   the cache_entry containing E. */
+static unsigned
+cache_index_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  struct cache_entry *ce = hash_entry (e, struct cache_entry, hash_elem);
+  return hash_int (ce->sector_idx);
+}
+
+/* Comparison function for the sector index. Compares cache
+   entries by sector number in ascending order. */
+static bool
+cache_index_less (const struct hash_elem *a, const struct hash_elem *b,
+                  void *aux UNUSED)
+{
+  struct cache_entry *ce_a = hash_entry (a, struct cache_entry, hash_elem);
+  struct cache_entry *ce_b = hash_entry (b, struct cache_entry, hash_elem);
+  return ce_a->sector_idx < ce_b->sector_idx;
+}
+
+/* Returns the shard that a block with sector number SECTOR
+   is cached in. Uses the high bits of the hash, since the
+   low bits pick the bucket in the shard's index. */
+static struct cache_shard *
+sector_to_shard (block_sector_t sector)
+{
+  return shards + (hash_int (sector) >> 16) % shard_cnt;
+}
+
+/* Returns true if a block with sector number SECTOR is
+   currently in the cache, without acquiring its rw_lock. The
+   answer may be out of date by the time it is returned. */
+static bool
+cache_contains (block_sector_t sector)
+{
+  struct cache_shard *shard = sector_to_shard (sector);
+  struct cache_entry key;
+
+  key.sector_idx = sector;
+  lock_acquire (&shard->lock);
+  bool present = hash_find (&shard->index, &key.hash_elem) != NULL;
+  lock_release (&shard->lock);
+
+  return present;
+}
+
+/* Returns the number of dirty blocks in the cache. The answer
+   may be out of date by the time it is returned. */
+static size_t
+cache_dirty_cnt (void)
+{
+  size_t cnt = 0;
+  for (size_t shard_idx = 0; shard_idx < shard_cnt; shard_idx++)
+    cnt += shards[shard_idx].dirty_cnt;
+  return cnt;
+}
+
+/* Clears the dirty flag of CE, whose shard's lock must be
+   held, and updates the shard's count of dirty blocks. */
+static void
+cache_clean (struct cache_entry *ce)
+{
+  ASSERT (lock_held_by_current_thread (&ce->shard->lock));
+
+  if (ce->dirty)
+    {
+      ce->dirty = false;
+      ce->shard->dirty_cnt--;
+    }
+}
+
+/* Wakes the processes waiting in cache_find_block() for the
+   rw_lock of CE, if there are any. Called after an exclusive
+   hold on the rw_lock is dropped, so that cache hits never
+   have to signal anyone. */
+static void
+cache_wake_waiters (struct cache_entry *ce)
+{
+  if (ce->waiters > 0)
+    {
+      lock_acquire (&ce->shard->lock);
+      cond_broadcast (&ce->shard->cond, &ce->shard->lock);
+      lock_release (&ce->shard->lock);
+    }
+}
+
 /* Translates CACHE_IDX into address of the corresponding
    cache slot in the cache. */
 void *
@@ -115,8 +313,8 @@ cache_get_block_exclusive (block_sector_t sector, enum inode_type type)
   struct cache_entry *ce = cache_metadata + cache_idx;
   rw_lock_shared_to_exclusive (&ce->rw_lock);
 
-  /* Always going to set dirty when acquiring in exclusive mode. */
-  ce->dirty = true;
+  /* The caller marks the block dirty with cache_mark_dirty()
+     if it modifies it. */
   return cache_idx_to_cache_block_addr (cache_idx);
 }
 
@@ -133,6 +331,31 @@ cache_get_block_shared (block_sector_t sector, enum inode_type type)
   return cache_idx_to_cache_block_addr (cache_idx);
 }
 
+/* Get a block with sector number SECTOR and sector type
+   TYPE into the cache, filled with zeros and marked dirty,
+   for a caller that is about to overwrite the sector's
+   current contents. The block is not read from disk unless
+   it is already in the cache.
+   
+   On function return, the rw_lock of the cache slot is
+   held in exclusive_acquire mode. */
+void *
+cache_get_block_zeroed (block_sector_t sector, enum sector_type type)
+{
+  bool present;
+  size_t cache_idx = cache_claim (sector, &present);
+  struct cache_entry *ce = cache_metadata + cache_idx;
+  if (present)
+    rw_lock_shared_to_exclusive (&ce->rw_lock);
+  ce->type = type;
+  ce->accessed = true;
+
+  void *cache_block_addr = cache_idx_to_cache_block_addr (cache_idx);
+  memset (cache_block_addr, 0, BLOCK_SECTOR_SIZE);
+  cache_mark_dirty (cache_block_addr);
+  return cache_block_addr;
+}
+
 /* Release exclusive hold on the rw_lock of the cache slot
    with address BLOCK_ADDR. */
 void
@@ -143,6 +366,7 @@ cache_exclusive_release (void *block_addr)
   size_t cache_idx = (block_addr - cache) / BLOCK_SECTOR_SIZE;
   struct cache_entry *ce = cache_metadata + cache_idx;
   rw_lock_exclusive_release (&ce->rw_lock);
+  cache_wake_waiters (ce);
 }
 
 /* Release shared hold on the rw_lock of the cache slot
@@ -179,6 +403,36 @@ cache_exclusive_to_shared (void *block_addr)
   size_t cache_idx = (block_addr - cache) / BLOCK_SECTOR_SIZE;
   struct cache_entry *ce = cache_idx_to_cache_entry (cache_idx);
   rw_lock_exclusive_to_shared (&ce->rw_lock);
+  cache_wake_waiters (ce);
+}
+
+/* Set the dirty flag of the cache slot with address
+   BLOCK_ADDR, on whose rw_lock a hold must be held, so that
+   the block is written back to disk before it is evicted.
+   Must be called by every process that modifies a block;
+   blocks that are only read are never written back.
+
+   A flush may write the block back while it is held in
+   shared_acquire mode, clearing the dirty flag, so a process
+   modifying a block it holds in that mode must call this
+   after the modification, not before. */
+void
+cache_mark_dirty (void *block_addr)
+{
+  ASSERT ((block_addr - cache) % BLOCK_SECTOR_SIZE == 0);
+
+  size_t cache_idx = (block_addr - cache) / BLOCK_SECTOR_SIZE;
+  struct cache_entry *ce = cache_idx_to_cache_entry (cache_idx);
+  if (!ce->dirty)
+    {
+      lock_acquire (&ce->shard->lock);
+      if (!ce->dirty)
+        {
+          ce->dirty = true;
+          ce->shard->dirty_cnt++;
+        }
+      lock_release (&ce->shard->lock);
+    }
 }
 
 /* Release the hold on the rw_lock of the cache slot with
@@ -206,276 +460,553 @@ cache_get_block (block_sector_t sector, enum sector_type type)
   size_t cache_idx = cache_load (sector);
   struct cache_entry *ce = cache_metadata + cache_idx;
   ce->type = type;
-  ce->sector_idx = sector;
   ce->accessed = true;
 
   return cache_idx;
 }
 
 /* Free the cache slot containing a block with sector
-   number SECTOR, and reset the fields of the corresponding
-   cache_entry. If the block with sector number SECTOR is
-   not in the cache, nothing needs to be done.
+   number SECTOR, without writing the block back to disk,
+   since the sector is being freed. If the block with sector
+   number SECTOR is not in the cache, nothing needs to be
+   done.
    
    If the block is in the cache, cache_find_block() will
    return with a rw_lock in shared_acquire mode on the
-   cache slot. Release this rw_lock after resetting fields
-   and before returning to caller. */
+   cache slot, which cache_discard() then releases. */
 void
 cache_free_slot (block_sector_t sector)
 {
-  size_t cache_idx = cache_find_block (sector);
+  struct cache_shard *shard = sector_to_shard (sector);
+  lock_acquire (&shard->lock);
+  size_t cache_idx = cache_find_block (shard, sector);
+  lock_release (&shard->lock);
   if (cache_idx == BLOCK_NOT_PRESENT)
     return;
-  
+
+  cache_discard (cache_idx_to_cache_block_addr (cache_idx));
+}
+
+/* Drop the block in the cache slot with address BLOCK_ADDR,
+   whose rw_lock must be held in shared_acquire mode, from
+   the cache without writing it back to disk, because its
+   disk sector is being freed, and release the rw_lock.
+
+   The block is cleaned first, so that no new flush picks
+   it up, and the rw_lock is then upgraded so that processes
+   still reading the block, such as a flush already writing
+   it, are done with it before the cache slot is freed. */
+void
+cache_discard (void *block_addr)
+{
+  ASSERT ((block_addr - cache) % BLOCK_SECTOR_SIZE == 0);
+
+  size_t cache_idx = (block_addr - cache) / BLOCK_SECTOR_SIZE;
   struct cache_entry *ce = cache_metadata + cache_idx;
+  struct cache_shard *shard = ce->shard;
+
+  lock_acquire (&shard->lock);
+  cache_clean (ce);
+  lock_release (&shard->lock);
+  rw_lock_shared_to_exclusive (&ce->rw_lock);
+
+  lock_acquire (&shard->lock);
+  hash_delete (&shard->index, &ce->hash_elem);
   ce->sector_idx = SECTOR_NOT_PRESENT;
-  ce->dirty = false;
+  cache_clean (ce);
   ce->accessed = false;
-  
-  bitmap_reset (cache_bitmap, cache_idx);
-  rw_lock_shared_release (&ce->rw_lock);
+  bitmap_reset (shard->free_map, cache_idx - shard->base);
+  lock_release (&shard->lock);
+
+  rw_lock_exclusive_release (&ce->rw_lock);
+  cache_wake_waiters (ce);
 }
 
 /* Flushes cache by writing all dirty blocks back to disk.
+
+   The dirty blocks are gathered and sorted by sector number,
+   so that they reach the disk in ascending order and runs of
+   contiguous sectors, up to CACHE_FLUSH_RUN_MAX long, are
+   copied together into a buffer and written with a single
+   transfer.
    
    The rw_lock for each cache_entry of a dirty block must
-   be obtained through shared_acquire and we wait for the
-   rw_lock for each dirty block rather than skipping. */
+   be obtained through shared_acquire. We wait for the
+   rw_lock of the first block of each run rather than
+   skipping it, but only try the rw_locks of the blocks that
+   would extend the run, so that the flush never waits while
+   holding a rw_lock. */
 void
 cache_flush (void)
 {
-  for (size_t idx = 0; idx < CACHE_SIZE; idx++)
+  struct cache_entry *run[CACHE_FLUSH_RUN_MAX];
+
+  lock_acquire (&flush_lock);
+
+  /* Gather the dirty blocks, and sort them by sector. */
+  size_t cnt = 0;
+  for (size_t idx = 0; idx < cache_size; idx++)
     {
       struct cache_entry *ce = cache_metadata + idx;
+      block_sector_t sector = ce->sector_idx;
+      if (ce->dirty && sector != SECTOR_NOT_PRESENT)
+        {
+          flush_slots[cnt].sector = sector;
+          flush_slots[cnt].cache_idx = idx;
+          cnt++;
+        }
+    }
+  qsort (flush_slots, cnt, sizeof *flush_slots, flush_slot_compare);
 
+  size_t slot_idx = 0;
+  while (slot_idx < cnt)
+    {
+      /* Start a run with the next block, if it still holds
+         the same dirty sector. */
+      block_sector_t start = flush_slots[slot_idx].sector;
+      struct cache_entry *ce = cache_metadata
+                               + flush_slots[slot_idx++].cache_idx;
       rw_lock_shared_acquire (&ce->rw_lock);
-      if (ce->sector_idx != SECTOR_NOT_PRESENT && ce->dirty)
+      if (!ce->dirty || ce->sector_idx != start)
         {
-          void *cache_block_addr = cache_idx_to_cache_block_addr (idx);
-          block_write (fs_device, ce->sector_idx, cache_block_addr);
+          rw_lock_shared_release (&ce->rw_lock);
+          continue;
         }
-      rw_lock_shared_release (&ce->rw_lock);
+      size_t run_cnt = 0;
+      run[run_cnt++] = ce;
+
+      /* Extend the run with blocks holding the following
+         sectors. */
+      while (slot_idx < cnt && run_cnt < CACHE_FLUSH_RUN_MAX
+             && flush_slots[slot_idx].sector == start + run_cnt)
+        {
+          ce = cache_metadata + flush_slots[slot_idx].cache_idx;
+          if (!rw_lock_shared_try_acquire (&ce->rw_lock))
+            break;
+          slot_idx++;
+          if (!ce->dirty || ce->sector_idx != start + run_cnt)
+            {
+              rw_lock_shared_release (&ce->rw_lock);
+              break;
+            }
+          run[run_cnt++] = ce;
+        }
+
+      /* Clear the dirty flags before copying, so that changes
+         made meanwhile by processes holding a block in
+         shared_acquire mode are either copied or dirty the
+         block again. */
+      for (size_t run_idx = 0; run_idx < run_cnt; run_idx++)
+        {
+          ce = run[run_idx];
+          lock_acquire (&ce->shard->lock);
+          cache_clean (ce);
+          lock_release (&ce->shard->lock);
+          memcpy (flush_buffer + run_idx * BLOCK_SECTOR_SIZE,
+                  cache_idx_to_cache_block_addr (ce->cache_idx),
+                  BLOCK_SECTOR_SIZE);
+        }
+      block_write_multiple (fs_device, start, run_cnt, flush_buffer);
+
+      for (size_t run_idx = 0; run_idx < run_cnt; run_idx++)
+        rw_lock_shared_release (&run[run_idx]->rw_lock);
     }
+
+  lock_release (&flush_lock);
 }
 
-/* Find a block in the cache to evict using the second
-   chance clock algorithm. Returns the cache_idx of the
-   slot occupied by the block to be evicted.
-   
-   On function return, the rw_lock for the chosen cache
+/* Orders flush_slots A and B by ascending sector number. */
+static int
+flush_slot_compare (const void *a_, const void *b_)
+{
+  const struct flush_slot *a = a_;
+  const struct flush_slot *b = b_;
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Find a block in SHARD to evict using the second chance
+   clock algorithm. Returns the cache_idx of the slot
+   occupied by the block to be evicted, or BLOCK_NOT_PRESENT
+   if every slot of SHARD stayed in use for two full turns
+   of the clock.
+
+   On successful return, the rw_lock for the chosen cache
    slot will be held in exclusive_acquire mode. It is the
    caller's responsibility to release it. */
 static size_t
-clock_find (void)
+clock_find (struct cache_shard *shard)
 {
-  ASSERT (lock_held_by_current_thread (&eviction_lock));
+  ASSERT (lock_held_by_current_thread (&shard->lock));
 
-  while (true)
+  for (size_t cnt = 0; cnt < 2 * shard->size; cnt++)
     {
-      if (rw_lock_shared_try_acquire (&lagging_hand->rw_lock))
+      struct cache_entry *ce = shard->lagging_hand;
+      if (rw_lock_shared_try_acquire (&ce->rw_lock))
         {
-          if (!lagging_hand->accessed &&
-              lagging_hand->rw_lock.active_readers == 1)
+          /* Never sleep on the upgrade while holding the shard
+             lock: a flush that holds the block in shared mode
+             may be waiting for the shard lock. */
+          if (!ce->accessed
+              && rw_lock_shared_try_to_exclusive (&ce->rw_lock))
             {
-              rw_lock_shared_to_exclusive (&lagging_hand->rw_lock);
-              size_t cache_idx = lagging_hand->cache_idx;
-              clock_advance ();
+              clock_advance (shard);
 
-              return cache_idx;
+              return ce->cache_idx;
             }
-          rw_lock_shared_release (&lagging_hand->rw_lock);
+          rw_lock_shared_release (&ce->rw_lock);
         }
-        
+
       /* Advance clock hand. */
-      clock_advance ();
+      clock_advance (shard);
     }
 
-  NOT_REACHED ();
+  return BLOCK_NOT_PRESENT;
 }
 
-/* Advance the hands of the clock algorithm by one cache
-   slot, wrapping around to the first slot if the end of
-   the cache is reached for either hand. */
+/* Advance the hands of the clock algorithm of SHARD by one
+   cache slot, wrapping around to the first slot of SHARD if
+   the end of its slots is reached for either hand. */
 static void
-clock_advance (void)
+clock_advance (struct cache_shard *shard)
 {
-  if (++lagging_hand >= cache_metadata + CACHE_SIZE)
-    lagging_hand = cache_metadata;
-  if (++leading_hand >= cache_metadata + CACHE_SIZE)
-    leading_hand = cache_metadata;
-  
-  leading_hand->accessed = false;
+  struct cache_entry *first = cache_metadata + shard->base;
+  struct cache_entry *end = first + shard->size;
+
+  if (++shard->lagging_hand >= end)
+    shard->lagging_hand = first;
+  if (++shard->leading_hand >= end)
+    shard->leading_hand = first;
+
+  shard->leading_hand->accessed = false;
 }
 
-/* Evicts a block from a cache slot it is in and returns
-   the cache_idx of the free cache slot. If the evicted
-   block is dirty, it is written back to disk. 
-   
-   The rw_lock of the cache slot is held in shared_acquire
-   mode after this function returns. */
+/* Evicts a block from a cache slot of SHARD and returns
+   the cache_idx of the free cache slot, or BLOCK_NOT_PRESENT
+   if no slot of SHARD can currently be evicted. If the
+   evicted block is dirty, it is written back to disk.
+
+   The rw_lock of the cache slot is held in exclusive_acquire
+   mode after this function returns successfully. */
 static size_t
-cache_evict_block (void)
+cache_evict_block (struct cache_shard *shard)
 {
-  size_t cache_idx = clock_find ();
+  size_t cache_idx = clock_find (shard);
+  if (cache_idx == BLOCK_NOT_PRESENT)
+    return BLOCK_NOT_PRESENT;
+
   struct cache_entry *ce = cache_metadata + cache_idx;
-  
+
   /* Write dirty block back to disk. */
   if (ce->dirty)
     {
       void *cache_block_addr = cache_idx_to_cache_block_addr (cache_idx);
       block_write (fs_device, ce->sector_idx, cache_block_addr);
     }
-  
-  /* Clear appropriate fields in cache_entry. */
+
+  /* Clear appropriate fields in cache_entry. The clock may
+     also hand back a slot freed by cache_free_slot(), so claim
+     it in the bitmap as well. */
+  if (ce->sector_idx != SECTOR_NOT_PRESENT)
+    hash_delete (&shard->index, &ce->hash_elem);
+  bitmap_mark (shard->free_map, cache_idx - shard->base);
   ce->sector_idx = SECTOR_NOT_PRESENT;
-  ce->dirty = false;
+  cache_clean (ce);
   ce->accessed = false;
 
-  /* Atomically convert exclusive_acquire on rw_lock to
-     shared_acquire so that all paths through cache_load()
-     return with the rw_lock in shared_acquire mode. */
-  rw_lock_exclusive_to_shared (&ce->rw_lock);
-
   return cache_idx;
 }
 
-/* Searches the cache to see if a block with sector number
+/* Searches SHARD to see if a block with sector number
    SECTOR is already loaded. If yes, the rw_lock of the
    cache_entry is obtained via shared_acquire, and the
    cache_idx of the loaded block is returned. Otherwise,
    return an error value indicating the requested block
-   is not present in the cache. */
+   is not present in the cache.
+
+   If the block is held exclusively, for example while it
+   is being read in from disk, waits on the condition
+   variable of SHARD until the exclusive hold is dropped. */
 static size_t
-cache_find_block (block_sector_t sector)
+cache_find_block (struct cache_shard *shard, block_sector_t sector)
 {
-  for (size_t idx = 0; idx < CACHE_SIZE; idx++)
+  ASSERT (lock_held_by_current_thread (&shard->lock));
+
+  struct cache_entry key;
+  struct hash_elem *e;
+
+  key.sector_idx = sector;
+  while ((e = hash_find (&shard->index, &key.hash_elem)) != NULL)
     {
-      struct cache_entry *ce = cache_metadata + idx;
+      struct cache_entry *ce = hash_entry (e, struct cache_entry, hash_elem);
+      ce->waiters++;
+      while (!rw_lock_shared_try_acquire (&ce->rw_lock))
+        cond_wait (&shard->cond, &shard->lock);
+      ce->waiters--;
+
+      /* If block still contains correct disk sector, return
+         given cache_idx. Else, it was evicted or freed while
+         we waited, so look the sector up again. */
       if (ce->sector_idx == sector)
-        {
-          while (!rw_lock_shared_try_acquire (&ce->rw_lock))
-            cond_wait (&eviction_cond, &eviction_lock);
-
-          /* If block still contains correct disk sector,
-             return given cache_idx. Else, restart search. */
-          if (ce->sector_idx == sector)
-            return ce->cache_idx;
-          else
-            idx = 0;
-        }
+        return ce->cache_idx;
+      rw_lock_shared_release (&ce->rw_lock);
     }
 
   return BLOCK_NOT_PRESENT;
 }
 
 /* Find a block with sector number SECTOR in the cache and
-   return the cache_idx of the slot it is in, or load the
-   block from disk into a slot if it isn't already in the
-   cache. Evict a block from the cache if necessary. 
-   
-   The rw_lock of the cache slot is held in shared_acquire
-   mode after this function returns. */
+   return the cache_idx of the slot it is in, or claim a slot
+   for the block if it isn't already in the cache. Evict a
+   block from the sector's shard if necessary.
+
+   If the block was found, sets *PRESENT to true and the
+   rw_lock of the cache slot is held in shared_acquire mode.
+   Otherwise, sets *PRESENT to false, and the rw_lock is held
+   in exclusive_acquire mode until the caller has read the
+   block in from disk. */
 static size_t
-cache_load (block_sector_t sector)
+cache_claim (block_sector_t sector, bool *present)
 {
+  struct cache_shard *shard = sector_to_shard (sector);
   size_t cache_idx;
   struct cache_entry *ce;
-  lock_acquire (&eviction_lock);
+  lock_acquire (&shard->lock);
 
-  /* Block already in cache, so just return the cache_idx. */
-  cache_idx = cache_find_block (sector);
-  if (cache_idx != BLOCK_NOT_PRESENT)
+  while (true)
     {
-      cond_broadcast (&eviction_cond, &eviction_lock);
-      lock_release (&eviction_lock);
-      return cache_idx;
-    }
+      /* Block already in cache, so just return the cache_idx. */
+      cache_idx = cache_find_block (shard, sector);
+      if (cache_idx != BLOCK_NOT_PRESENT)
+        {
+          lock_release (&shard->lock);
+          *present = true;
+          return cache_idx;
+        }
 
-  /* Block not in cache, so find a free slot and load it in. */
-  cache_idx = bitmap_scan_and_flip (cache_bitmap, 0, 1, false);
+      /* Block not in cache, so find a free slot and load it in.
+         A free slot is not in the sector index, so no other
+         process can hold its rw_lock for long. Otherwise, the
+         shard is full, so evict a block from one of its slots
+         to obtain a free slot for the new block. Either way,
+         the rw_lock of the slot is held in exclusive_acquire
+         mode. */
+      size_t slot = bitmap_scan_and_flip (shard->free_map, 0, 1, false);
+      if (slot != BITMAP_ERROR)
+        {
+          cache_idx = shard->base + slot;
+          rw_lock_exclusive_acquire (&cache_metadata[cache_idx].rw_lock);
+          break;
+        }
+      cache_idx = cache_evict_block (shard);
+      if (cache_idx != BLOCK_NOT_PRESENT)
+        break;
+
+      /* Every slot of the shard is in use. Let the holders run,
+         then look the block up again since another process may
+         have loaded it in the meantime. */
+      lock_release (&shard->lock);
+      thread_yield ();
+      lock_acquire (&shard->lock);
+    }
 
-  /* A free cache slot is available, so obtain the rw_lock on
-     the cache_entry and set the sector_idx field. */
+  /* Publish the new sector in the index before reading it in.
+     Processes that find it meanwhile wait on the shard's
+     condition variable until the exclusive hold is dropped. */
   ce = cache_metadata + cache_idx;
-  if (cache_idx != BITMAP_ERROR && 
-      rw_lock_shared_try_acquire (&ce->rw_lock))
-    {
-      cond_broadcast (&eviction_cond, &eviction_lock);
-      lock_release (&eviction_lock);
+  ce->sector_idx = sector;
+  hash_insert (&shard->index, &ce->hash_elem);
+  lock_release (&shard->lock);
 
-      void *cache_block_addr = cache_idx_to_cache_block_addr (cache_idx);
-      block_read (fs_device, sector, cache_block_addr);
-      return cache_idx;
-    }
+  *present = false;
+  return cache_idx;
+}
 
-  /* Cache is full, so evict a block from a cache slot to
-     obtain a free slot for the new block. Can release
-     eviction_lock since we will have shared lock on the
-     returned cache slot, ensuring that the block will not
-     be evicted by another process. */
-  cache_idx = cache_evict_block ();
-  cond_broadcast (&eviction_cond, &eviction_lock);
-  lock_release (&eviction_lock);
+/* Find a block with sector number SECTOR in the cache and
+   return the cache_idx of the slot it is in, or load the
+   block from disk into a slot if it isn't already in the
+   cache.
 
+   The rw_lock of the cache slot is held in shared_acquire
+   mode after this function returns. */
+static size_t
+cache_load (block_sector_t sector)
+{
+  bool present;
+  size_t cache_idx = cache_claim (sector, &present);
+  if (present)
+    return cache_idx;
+
+  struct cache_entry *ce = cache_metadata + cache_idx;
   void *cache_block_addr = cache_idx_to_cache_block_addr (cache_idx);
   block_read (fs_device, sector, cache_block_addr);
+
+  /* Atomically convert exclusive_acquire on rw_lock to
+     shared_acquire so that all paths through cache_load()
+     return with the rw_lock in shared_acquire mode. */
+  rw_lock_exclusive_to_shared (&ce->rw_lock);
+  cache_wake_waiters (ce);
   return cache_idx;
 }
 
-/* Signals the read-ahead worker thread that a block has
-   been enqueued to be loaded into the cache. */
+/* Enqueues the CNT blocks with sector numbers SECTORS to be
+   loaded into the cache, in order, and signals the read-ahead
+   worker thread.
+
+   Blocks that are already in the cache or already queued are
+   skipped, as are blocks that do not fit in the queue, since
+   read-ahead is only an optimization. */
 void
-read_ahead_signal (block_sector_t sector)
+read_ahead_signal (const block_sector_t *sectors, size_t cnt)
 {
-  struct sector_elem *se = malloc (sizeof (struct sector_elem));
-  if (se == NULL)
-    PANIC ("read_ahead_signal: memory allocation failed for sector_elem.");
+  for (size_t idx = 0; idx < cnt; idx++)
+    {
+      if (cache_contains (sectors[idx]))
+        {
+          read_ahead_hit_cnt++;
+          continue;
+        }
 
-  se->sector = sector;
-  list_push_back (&read_ahead_list, &se->elem);
-  sema_up (&read_ahead_sema);
+      lock_acquire (&read_ahead_lock);
+      if (read_ahead_cnt == READ_AHEAD_QUEUE_SIZE
+          || read_ahead_queued (sectors[idx]))
+        read_ahead_drop_cnt++;
+      else
+        {
+          size_t tail = (read_ahead_head + read_ahead_cnt)
+                        % READ_AHEAD_QUEUE_SIZE;
+          read_ahead_queue[tail] = sectors[idx];
+          read_ahead_cnt++;
+          read_ahead_queued_cnt++;
+          cond_signal (&read_ahead_cond, &read_ahead_lock);
+        }
+      lock_release (&read_ahead_lock);
+    }
 }
 
-/* A thread function that fetches the next block of a file
-   into the cache when one block of a file is read.
+/* Returns true if a block with sector number SECTOR is in the
+   read-ahead queue or being loaded by the read-ahead worker
+   thread. */
+static bool
+read_ahead_queued (block_sector_t sector)
+{
+  ASSERT (lock_held_by_current_thread (&read_ahead_lock));
+
+  if (sector - read_ahead_current < read_ahead_current_cnt)
+    return true;
+  for (size_t idx = 0; idx < read_ahead_cnt; idx++)
+    if (read_ahead_queue[(read_ahead_head + idx)
+                         % READ_AHEAD_QUEUE_SIZE] == sector)
+      return true;
+  return false;
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  printf ("Cache: %lld sectors read ahead, %lld already cached, "
+          "%lld dropped\n", read_ahead_queued_cnt, read_ahead_hit_cnt,
+          read_ahead_drop_cnt);
+}
+
+/* A thread function that fetches the blocks ahead of a
+   sequential reader of a file into the cache.
   
-   The read-ahead worker thread keeps track of a list of
-   blocks to fetch, and sleeps until signaled by another
-   process that the list is non-empty. */
+   The read-ahead worker thread takes the longest run of
+   contiguous sectors, up to CACHE_RUN_MAX, from the front
+   of the read-ahead queue, and sleeps until signaled by
+   another process that the queue is non-empty. It claims
+   cache slots for the blocks of the run that are not yet
+   cached and reads the run from disk with one transfer. */
 static void
 cache_read_ahead (void *aux UNUSED)
 {
+  size_t cache_idxs[CACHE_RUN_MAX];
+  bool present[CACHE_RUN_MAX];
+
   while (true)
     {
-      sema_down (&read_ahead_sema);
-      ASSERT (!list_empty (&read_ahead_list));
-      
-      struct list_elem *e = list_pop_front (&read_ahead_list);
-      struct sector_elem *se = list_entry (e, struct sector_elem, elem);
-    
-      size_t cache_idx = cache_get_block (se->sector, DATA);
-      struct cache_entry *ce = cache_metadata + cache_idx;
-      rw_lock_shared_release (&ce->rw_lock);
+      lock_acquire (&read_ahead_lock);
+      read_ahead_current_cnt = 0;
+      while (read_ahead_cnt == 0)
+        cond_wait (&read_ahead_cond, &read_ahead_lock);
+
+      read_ahead_current = read_ahead_queue[read_ahead_head];
+      do
+        {
+          read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE_SIZE;
+          read_ahead_cnt--;
+          read_ahead_current_cnt++;
+        }
+      while (read_ahead_cnt > 0 && read_ahead_current_cnt < CACHE_RUN_MAX
+             && read_ahead_queue[read_ahead_head]
+                == read_ahead_current + read_ahead_current_cnt);
+      block_sector_t sector = read_ahead_current;
+      size_t cnt = read_ahead_current_cnt;
+      lock_release (&read_ahead_lock);
+
+      /* Claim slots, and trim the run to the blocks that must
+         actually be read in. */
+      size_t first = cnt, last = 0;
+      for (size_t idx = 0; idx < cnt; idx++)
+        {
+          cache_idxs[idx] = cache_claim (sector + idx, &present[idx]);
+          if (!present[idx])
+            {
+              if (first == cnt)
+                first = idx;
+              last = idx;
+            }
+        }
+
+      if (first < cnt)
+        block_read_multiple (fs_device, sector + first, last - first + 1,
+                             read_ahead_buffer);
 
-      /* Deallocate memory for sector elem. */
-      free (se);
+      for (size_t idx = 0; idx < cnt; idx++)
+        {
+          struct cache_entry *ce = cache_metadata + cache_idxs[idx];
+          if (!present[idx])
+            {
+              memcpy (cache_idx_to_cache_block_addr (cache_idxs[idx]),
+                      read_ahead_buffer + (idx - first) * BLOCK_SECTOR_SIZE,
+                      BLOCK_SECTOR_SIZE);
+              ce->type = DATA;
+              ce->accessed = true;
+              rw_lock_exclusive_to_shared (&ce->rw_lock);
+              cache_wake_waiters (ce);
+            }
+          rw_lock_shared_release (&ce->rw_lock);
+        }
     }
 }
 
 /* A thread function that periodically writes the free map
    and all dirty blocks in the cache back to disk.
    
-   The periodic-flush worker repeatedly sleeps for a
-   specified amount of time (default 10 seconds) then
-   wakes up and flushes the free map and cache. */
+   The periodic-flush worker wakes up every CACHE_FLUSH_POLL
+   milliseconds. Once flush_interval milliseconds (default
+   10 seconds) have passed since the last flush, or once more
+   than 1/CACHE_DIRTY_RATIO of the cache holds dirty blocks,
+   it flushes the free map and the cache. Dirty blocks are
+   counted after the free map is written to the cache, so a
+   cache with nothing dirty is not flushed. */
 static void
 cache_periodic_flush (void *aux UNUSED)
 {
+  unsigned elapsed = 0;
+
   while (true)
     {
-      timer_msleep (10 * 1000);
-      cache_flush ();
+      timer_msleep (CACHE_FLUSH_POLL);
+      elapsed += CACHE_FLUSH_POLL;
+      if (elapsed < flush_interval
+          && cache_dirty_cnt () <= cache_size / CACHE_DIRTY_RATIO)
+        continue;
+
+      elapsed = 0;
       free_map_flush ();
+      if (cache_dirty_cnt () > 0)
+        cache_flush ();
     }
 }
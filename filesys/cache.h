@@ -1,12 +1,35 @@
 #ifndef FILESYS_CACHE_H
 #define FILESYS_CACHE_H
 
+#include <hash.h>
 #include "filesys/inode.h"
 #include "devices/block.h"
 #include "threads/synch.h"
 
-/* Number of sectors that fit in the cache. */
-#define CACHE_SIZE 64
+/* Default number of sectors that fit in the cache, and the
+   smallest number that the cache may be configured to hold. */
+#define CACHE_DEFAULT_SIZE 64
+#define CACHE_MIN_SIZE 16
+
+/* Maximum number of independently locked cache shards, and
+   the fewest cache slots that each shard may own. */
+#define CACHE_MAX_SHARDS 16
+#define CACHE_SHARD_MIN_SIZE 16
+
+/* Default number of milliseconds between flushes of dirty
+   blocks, and the number of milliseconds the flush worker
+   sleeps between checks of the number of dirty blocks. A
+   flush starts early once more than 1/CACHE_DIRTY_RATIO of
+   the cache slots hold dirty blocks. */
+#define CACHE_FLUSH_INTERVAL 10000
+#define CACHE_FLUSH_POLL 100
+#define CACHE_DIRTY_RATIO 4
+
+/* Maximum number of sectors written by one flush transfer. */
+#define CACHE_FLUSH_RUN_MAX 32
+
+/* Number of sectors the read-ahead queue can hold. */
+#define READ_AHEAD_QUEUE_SIZE 64
 
 /* Error value indicating block not found in cache. */
 #define BLOCK_NOT_PRESENT SIZE_MAX
@@ -21,25 +44,43 @@ enum sector_type
     DATA    /* A data sector. */
   };
 
+/* Cache shard. Each sector maps to exactly one shard by a
+   hash of its sector number, and a shard owns a contiguous
+   range of cache slots that only its sectors are loaded
+   into. Lookups and evictions in different shards never
+   contend for the same lock. */
+struct cache_shard
+  {
+    struct lock lock;                   /* Protects fields below. */
+    struct condition cond;              /* Signaled when a slot with
+                                           waiters is released. */
+    struct hash index;                  /* Sector -> cache_entry. */
+    struct bitmap *free_map;            /* Free slots of the shard. */
+    size_t base;                        /* First cache_idx of shard. */
+    size_t size;                        /* Number of slots in shard. */
+    struct cache_entry *lagging_hand;   /* Clock hands for eviction. */
+    struct cache_entry *leading_hand;
+    size_t dirty_cnt;                   /* Number of dirty slots. */
+  };
+
 /* Cache entry. */
 struct cache_entry
   {
     enum sector_type type;      /* Sector type (inode or data). */
     block_sector_t sector_idx;  /* Sector number of disk location. */
     size_t cache_idx;           /* Index in the buffer cache. */
-    bool dirty;                 /* Dirty flag for writes. */
+    bool dirty;                 /* Dirty flag for writes. Only
+                                   changed under shard->lock. */
     bool accessed;              /* Flag for reads or writes. */
     struct rw_lock rw_lock;     /* Readers-writer lock. */
+    struct cache_shard *shard;  /* Shard that owns the slot. */
+    struct hash_elem hash_elem; /* Element in the shard's index. */
+    size_t waiters;             /* Processes waiting on shard->cond
+                                   to acquire rw_lock. */
   };
 
-/* Block sector element that allows block sector numbers
-   to be placed in a list. */
-struct sector_elem 
-  {
-    block_sector_t sector;      /* Sector number of disk location. */
-    struct list_elem elem;      /* List element. */
-  };
-
+void cache_configure (size_t sector_cnt);
+void cache_configure_flush (unsigned interval_ms);
 void cache_init (void);
 
 void *cache_idx_to_cache_block_addr (size_t cache_idx);
@@ -47,17 +88,22 @@ struct cache_entry *cache_idx_to_cache_entry (size_t cache_idx);
 
 void *cache_get_block_exclusive (block_sector_t sector, enum inode_type type);
 void *cache_get_block_shared (block_sector_t sector, enum inode_type type);
+void *cache_get_block_zeroed (block_sector_t sector, enum sector_type type);
 void cache_exclusive_release (void *block_addr);
 void cache_shared_release (void *block_addr);
 
 void cache_shared_to_exclusive (void *block_addr);
 void cache_exclusive_to_shared (void *block_addr);
 void cache_conditional_release (void *block_addr, bool exclusive);
+void cache_mark_dirty (void *block_addr);
 
 size_t cache_get_block (block_sector_t sector, enum sector_type type);
 void cache_free_slot (block_sector_t sector);
+void cache_discard (void *block_addr);
 void cache_flush (void);
 
-void read_ahead_signal (block_sector_t sector);
+void cache_print_stats (void);
+
+void read_ahead_signal (const block_sector_t *sectors, size_t cnt);
 
 #endif /* filesys/cache.h */
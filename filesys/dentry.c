@@ -0,0 +1,199 @@
+#include "filesys/dentry.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Cached entries, hashed by parent sector and name. */
+static struct hash dentry_table;
+
+/* Cached entries, least recently used first. */
+static struct list dentry_lru;
+
+/* Number of cached entries. */
+static size_t dentry_cnt;
+
+/* Incremented on every invalidation. A search of a directory
+   on disk only caches its result if no invalidation happened
+   since it started, so that a result that a concurrent
+   dir_add() or dir_remove() made stale is never cached. */
+static unsigned dentry_gen;
+
+/* Protects the fields above. */
+static struct lock dentry_lock;
+
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+static struct dentry *dentry_find (block_sector_t parent, const char *name);
+static void dentry_delete (struct dentry *d);
+
+/* Initializes the dentry cache. */
+void
+dentry_init (void)
+{
+  if (!hash_init (&dentry_table, dentry_hash, dentry_less, NULL))
+    PANIC ("dentry_init: failed memory allocation for dentry table.");
+  list_init (&dentry_lru);
+  lock_init (&dentry_lock);
+  dentry_cnt = 0;
+  dentry_gen = 0;
+}
+
+/* Searches the dentry cache for NAME in the directory whose
+   inode is in sector PARENT. If found, returns true and sets
+   *SECTOR to the sector of the file's inode, or to
+   SECTOR_NOT_PRESENT if the directory is known to have no
+   file by that name. Otherwise, returns false and sets *GEN
+   to the value that must be passed to dentry_insert() once
+   the directory has been searched on disk. */
+bool
+dentry_lookup (block_sector_t parent, const char *name,
+               block_sector_t *sector, unsigned *gen)
+{
+  lock_acquire (&dentry_lock);
+  struct dentry *d = dentry_find (parent, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_back (&dentry_lru, &d->lru_elem);
+      *sector = d->sector;
+    }
+  *gen = dentry_gen;
+  lock_release (&dentry_lock);
+
+  return d != NULL;
+}
+
+/* Caches SECTOR as the result of searching the directory
+   whose inode is in sector PARENT for NAME, evicting the
+   least recently used entry if the cache is full. GEN is the
+   value that dentry_lookup() set before the search started.
+   Nothing is cached if an entry was invalidated since then
+   or if NAME is too long to be a file name. */
+void
+dentry_insert (block_sector_t parent, const char *name,
+               block_sector_t sector, unsigned gen)
+{
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dentry_lock);
+  if (gen != dentry_gen || dentry_find (parent, name) != NULL)
+    {
+      lock_release (&dentry_lock);
+      return;
+    }
+
+  /* Reuse the least recently used entry if the cache is
+     full, otherwise allocate a new one. */
+  struct dentry *d;
+  if (dentry_cnt >= DENTRY_CACHE_SIZE)
+    {
+      d = list_entry (list_front (&dentry_lru), struct dentry, lru_elem);
+      hash_delete (&dentry_table, &d->hash_elem);
+      list_remove (&d->lru_elem);
+      dentry_cnt--;
+    }
+  else
+    d = malloc (sizeof *d);
+
+  if (d != NULL)
+    {
+      d->parent = parent;
+      strlcpy (d->name, name, sizeof d->name);
+      d->sector = sector;
+      hash_insert (&dentry_table, &d->hash_elem);
+      list_push_back (&dentry_lru, &d->lru_elem);
+      dentry_cnt++;
+    }
+  lock_release (&dentry_lock);
+}
+
+/* Drops any cached entry for NAME in the directory whose
+   inode is in sector PARENT. Must be called after the
+   directory entry is changed on disk. */
+void
+dentry_invalidate (block_sector_t parent, const char *name)
+{
+  lock_acquire (&dentry_lock);
+  struct dentry *d = dentry_find (parent, name);
+  if (d != NULL)
+    dentry_delete (d);
+  dentry_gen++;
+  lock_release (&dentry_lock);
+}
+
+/* Drops all cached entries of the directory whose inode is
+   in sector PARENT. Called when a removed directory's sector
+   is freed, and again when a new directory is created in
+   PARENT, so that no entry of a directory that used the
+   sector before is ever found. */
+void
+dentry_invalidate_dir (block_sector_t parent)
+{
+  lock_acquire (&dentry_lock);
+  struct list_elem *e = list_begin (&dentry_lru);
+  while (e != list_end (&dentry_lru))
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      e = list_next (e);
+      if (d->parent == parent)
+        dentry_delete (d);
+    }
+  dentry_gen++;
+  lock_release (&dentry_lock);
+}
+
+/* Returns the cached entry for NAME in the directory whose
+   inode is in sector PARENT, or a null pointer if there is
+   none. dentry_lock must be held. */
+static struct dentry *
+dentry_find (block_sector_t parent, const char *name)
+{
+  ASSERT (lock_held_by_current_thread (&dentry_lock));
+
+  struct dentry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.parent = parent;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentry_table, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Removes D from the dentry cache and frees it. dentry_lock
+   must be held. */
+static void
+dentry_delete (struct dentry *d)
+{
+  ASSERT (lock_held_by_current_thread (&dentry_lock));
+
+  hash_delete (&dentry_table, &d->hash_elem);
+  list_remove (&d->lru_elem);
+  dentry_cnt--;
+  free (d);
+}
+
+/* Returns a hash value for dentry E. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->parent);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  return strcmp (a->name, b->name) < 0;
+}
@@ -0,0 +1,37 @@
+#ifndef FILESYS_DENTRY_H
+#define FILESYS_DENTRY_H
+
+#include <hash.h>
+#include <list.h>
+#include <stdbool.h>
+#include "devices/block.h"
+#include "filesys/directory.h"
+
+/* Maximum number of directory entries kept in the dentry
+   cache. */
+#define DENTRY_CACHE_SIZE 256
+
+/* Cached directory entry, mapping a name in the directory
+   whose inode is in sector PARENT to the sector of the
+   named file's inode. A negative entry records that the
+   directory has no file by that name. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dentry_table. */
+    struct list_elem lru_elem;          /* Element in dentry_lru. */
+    block_sector_t parent;              /* Sector of directory inode. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    block_sector_t sector;              /* Sector of file inode, or
+                                           SECTOR_NOT_PRESENT if
+                                           negative. */
+  };
+
+void dentry_init (void);
+bool dentry_lookup (block_sector_t parent, const char *name,
+                    block_sector_t *sector, unsigned *gen);
+void dentry_insert (block_sector_t parent, const char *name,
+                    block_sector_t sector, unsigned gen);
+void dentry_invalidate (block_sector_t parent, const char *name);
+void dentry_invalidate_dir (block_sector_t parent);
+
+#endif /* filesys/dentry.h */
@@ -1,19 +1,85 @@
 #include "filesys/directory.h"
+#include <hash.h>
 #include <list.h>
 #include <stdio.h>
 #include <string.h>
 #include "filesys/cache.h"
+#include "filesys/dentry.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 #include "threads/thread.h"
 
-/* Creates a directory with space for ENTRY_CNT entries in
-   SECTOR.  Returns true if successful, false on failure. */
+/* A directory is either linear or hashed. A linear directory
+   is an array of entries that is searched in order. A hashed
+   directory begins with a header sector that holds the "."
+   and ".." entries followed by a header entry, which is never
+   in use and records the number of hash buckets. Each bucket
+   is one sector, and a name is stored in the bucket that it
+   hashes to. The last entry of a bucket is never in use, and
+   its inode_sector is the file block of the bucket's overflow
+   bucket, or 0 if there is none. Since every other entry of
+   a hashed directory is a dir_entry that is not in use, code
+   that reads a directory in order works on both formats. */
+
+/* Number of directory entries in a sector. */
+#define DIR_BLOCK_ENTRIES (BLOCK_SECTOR_SIZE / sizeof (struct dir_entry))
+
+/* Entries in a hash bucket that hold names. The remaining
+   entry links to the overflow bucket. */
+#define DIR_BUCKET_ENTRIES (DIR_BLOCK_ENTRIES - 1)
+
+/* Offset of the header entry of a hashed directory. */
+#define DIR_HEADER_OFS DIR_OFFSET
+
+/* Name of the header entry of a hashed directory. It contains
+   a slash, so it can never be the name of a file. */
+#define DIR_HASH_MAGIC "/hashed"
+
+/* Creates a hashed directory in SECTOR with "." and ".."
+   entries for itself and for the directory in PARENT_SECTOR.
+   The buckets are holes until entries are added to them.
+   Returns true if successful, false on failure. On failure,
+   no data block of the directory is left allocated. */
 bool
-dir_create (block_sector_t sector, size_t entry_cnt)
+dir_create (block_sector_t sector, block_sector_t parent_sector)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry), DIR);
+  struct dir_entry *entries;
+  struct inode *inode;
+  bool success = false;
+
+  ASSERT (BLOCK_SECTOR_SIZE % sizeof (struct dir_entry) == 0);
+
+  entries = calloc (DIR_BLOCK_ENTRIES, sizeof *entries);
+  if (entries == NULL)
+    return false;
+
+  if (!inode_create (sector, (DIR_BUCKET_CNT + 1) * BLOCK_SECTOR_SIZE, DIR))
+    {
+      free (entries);
+      return false;
+    }
+  dentry_invalidate_dir (sector);
+
+  entries[0].inode_sector = sector;
+  strlcpy (entries[0].name, ".", sizeof entries[0].name);
+  entries[0].in_use = true;
+  entries[1].inode_sector = parent_sector;
+  strlcpy (entries[1].name, "..", sizeof entries[1].name);
+  entries[1].in_use = true;
+  entries[DIR_HEADER_OFS / sizeof *entries].inode_sector = DIR_BUCKET_CNT;
+  strlcpy (entries[DIR_HEADER_OFS / sizeof *entries].name, DIR_HASH_MAGIC,
+           sizeof entries->name);
+
+  /* Write the header sector. */
+  inode = inode_open (sector);
+  success = (inode != NULL
+             && inode_write_at (inode, entries, BLOCK_SECTOR_SIZE, 0)
+                == BLOCK_SECTOR_SIZE);
+  inode_close (inode);
+  free (entries);
+
+  return success;
 }
 
 /* Opens and returns the directory for INODE, of which it
@@ -79,34 +145,173 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Reads the entries of DIR from byte offset OFS up to the
+   end of its sector into ENTRIES. Returns the number of
+   entries read, which is 0 at the end of DIR. */
+static size_t
+read_entries (const struct dir *dir, off_t ofs,
+              struct dir_entry entries[DIR_BLOCK_ENTRIES])
+{
+  off_t size = BLOCK_SECTOR_SIZE - ofs % BLOCK_SECTOR_SIZE;
+  return inode_read_at (dir->inode, entries, size, ofs) / sizeof *entries;
+}
+
+/* Returns the number of hash buckets of DIR, or 0 if DIR is
+   a linear directory. */
+static size_t
+bucket_cnt (const struct dir *dir)
+{
+  struct dir_entry e;
+
+  if (inode_read_at (dir->inode, &e, sizeof e, DIR_HEADER_OFS) == sizeof e
+      && !e.in_use && !strcmp (e.name, DIR_HASH_MAGIC))
+    return e.inode_sector;
+  return 0;
+}
+
+/* Returns the file block of the bucket for NAME in a hashed
+   directory with BUCKETS buckets. The "." and ".." entries
+   are kept in the header sector, block 0. */
+static size_t
+name_to_bucket (const char *name, size_t buckets)
+{
+  if (!strcmp (name, ".") || !strcmp (name, ".."))
+    return 0;
+  return 1 + hash_string (name) % buckets;
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory
    entry if EP is non-null, and sets *OFSP to the byte
    offset of the directory entry if OFSP is non-null.
-   Otherwise, returns false and ignores EP and OFSP. */
+   Otherwise, returns false and ignores EP and OFSP.
+
+   A hashed directory is searched only in the bucket that
+   NAME hashes to and in the bucket's overflow buckets, a
+   linear directory from its beginning. */
 static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
-  size_t ofs;
+  struct dir_entry entries[DIR_BLOCK_ENTRIES];
+  size_t buckets;
+  size_t cnt, i;
+  off_t ofs;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
+  buckets = bucket_cnt (dir);
+  if (buckets > 0)
     {
-      if (e.in_use && !strcmp (name, e.name)) 
+      size_t block = name_to_bucket (name, buckets);
+      do
         {
-          if (ep != NULL)
-            *ep = e;
-          if (ofsp != NULL)
-            *ofsp = ofs;
-          return true;
+          ofs = block * BLOCK_SECTOR_SIZE;
+          if (read_entries (dir, ofs, entries) != DIR_BLOCK_ENTRIES)
+            return false;
+          for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+            if (entries[i].in_use && !strcmp (name, entries[i].name))
+              goto found;
+          block = entries[DIR_BUCKET_ENTRIES].inode_sector;
         }
+      while (block != 0);
+      return false;
     }
+
+  for (ofs = 0; (cnt = read_entries (dir, ofs, entries)) > 0;
+       ofs += cnt * sizeof *entries)
+    for (i = 0; i < cnt; i++)
+      if (entries[i].in_use && !strcmp (name, entries[i].name))
+        goto found;
   return false;
+
+ found:
+  if (ep != NULL)
+    *ep = entries[i];
+  if (ofsp != NULL)
+    *ofsp = ofs + i * sizeof *entries;
+  return true;
+}
+
+/* Writes E into the first free entry of the bucket chain of
+   hashed directory DIR with BUCKETS buckets for E's name.
+   If every entry of the chain is in use, appends an overflow
+   bucket holding E to DIR and links it to the end of the
+   chain. The bucket is written before it is linked, so that
+   concurrent lookups never follow a link to an unwritten
+   bucket. Returns true if successful, false on failure. */
+static bool
+hash_add (struct dir *dir, size_t buckets, const struct dir_entry *e)
+{
+  struct dir_entry entries[DIR_BLOCK_ENTRIES];
+  size_t block = name_to_bucket (e->name, buckets);
+  struct dir_entry *link = &entries[DIR_BUCKET_ENTRIES];
+  off_t link_ofs, ofs;
+  size_t i;
+
+  while (true)
+    {
+      ofs = block * BLOCK_SECTOR_SIZE;
+      if (read_entries (dir, ofs, entries) != DIR_BLOCK_ENTRIES)
+        return false;
+      for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+        if (!entries[i].in_use)
+          {
+            ofs += i * sizeof *entries;
+            return (inode_write_at (dir->inode, e, sizeof *e, ofs)
+                    == sizeof *e);
+          }
+      if (link->inode_sector == 0)
+        break;
+      block = link->inode_sector;
+    }
+  link_ofs = ofs + DIR_BUCKET_ENTRIES * sizeof *entries;
+
+  /* Append overflow bucket. */
+  ofs = inode_length (dir->inode);
+  memset (entries, 0, sizeof entries);
+  entries[0] = *e;
+  if (inode_write_at (dir->inode, entries, BLOCK_SECTOR_SIZE, ofs)
+      != BLOCK_SECTOR_SIZE)
+    return false;
+
+  /* Link it to the chain. */
+  memset (link, 0, sizeof *link);
+  link->inode_sector = ofs / BLOCK_SECTOR_SIZE;
+  return (inode_write_at (dir->inode, link, sizeof *link, link_ofs)
+          == sizeof *link);
+}
+
+/* Searches the directory with open inode DIR_INODE for a
+   file with the given NAME. Returns the sector of the file's
+   inode, or SECTOR_NOT_PRESENT if there is no such file.
+
+   The result, even if there is no such file, is kept in the
+   dentry cache, so that repeated searches for NAME do not
+   read the directory. */
+block_sector_t
+dir_lookup_sector (struct inode *dir_inode, const char *name)
+{
+  struct dir_entry e;
+  block_sector_t sector;
+  unsigned gen;
+
+  ASSERT (dir_inode != NULL);
+  ASSERT (name != NULL);
+
+  block_sector_t dir_sector = inode_get_inumber (dir_inode);
+  if (dentry_lookup (dir_sector, name, &sector, &gen))
+    return sector;
+
+  struct dir *dir = dir_open (inode_reopen (dir_inode));
+  if (dir == NULL)
+    return SECTOR_NOT_PRESENT;
+  sector = lookup (dir, name, &e, NULL) ? e.inode_sector : SECTOR_NOT_PRESENT;
+  dir_close (dir);
+
+  dentry_insert (dir_sector, name, sector, gen);
+  return sector;
 }
 
 /* Searches DIR for a file with the given NAME and returns
@@ -116,13 +321,14 @@ lookup (const struct dir *dir, const char *name,
 bool
 dir_lookup (const struct dir *dir, const char *name, struct inode **inode)
 {
-  struct dir_entry e;
+  block_sector_t sector;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
+  sector = dir_lookup_sector (dir->inode, name);
+  if (sector != SECTOR_NOT_PRESENT)
+    *inode = inode_open (sector);
   else
     *inode = NULL;
 
@@ -139,7 +345,8 @@ dir_lookup (const struct dir *dir, const char *name, struct inode **inode)
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {  
-  struct dir_entry e;
+  struct dir_entry e, slot;
+  size_t buckets;
   off_t ofs;
   bool success = false;
 
@@ -154,24 +361,35 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
+  e.in_use = true;
+  strlcpy (e.name, name, sizeof e.name);
+  e.inode_sector = inode_sector;
+
+  /* In a hashed directory, write the entry into its bucket. */
+  buckets = bucket_cnt (dir);
+  if (buckets > 0)
+    {
+      success = hash_add (dir, buckets, &e);
+      goto done;
+    }
+
   /* Set OFS to offset of free slot. If there are no free slots,
      then it will be set to the current end-of-file.
      
      inode_read_at() will only return a short read at end of file.
      Otherwise, we'd need to verify that we didn't get a short
      read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
+  for (ofs = 0;
+       inode_read_at (dir->inode, &slot, sizeof slot, ofs) == sizeof slot;
+       ofs += sizeof slot) 
+    if (!slot.in_use)
       break;
 
   /* Write slot. */
-  e.in_use = true;
-  strlcpy (e.name, name, sizeof e.name);
-  e.inode_sector = inode_sector;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
  done:
+  dentry_invalidate (inode_get_inumber (dir->inode), name);
   return success;
 }
 
@@ -209,6 +427,7 @@ dir_remove (struct dir *dir, const char *name)
   success = true;
 
  done:
+  dentry_invalidate (inode_get_inumber (dir->inode), name);
   inode_close (inode);
   return success;
 }
@@ -219,16 +438,19 @@ dir_remove (struct dir *dir, const char *name)
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
-  struct dir_entry e;
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e)
-    {
-      dir->pos += sizeof e;
-      if (e.in_use)
-        {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
-        }
-    }
+  struct dir_entry entries[DIR_BLOCK_ENTRIES];
+  size_t cnt;
+
+  while ((cnt = read_entries (dir, dir->pos, entries)) > 0)
+    for (size_t i = 0; i < cnt; i++)
+      {
+        dir->pos += sizeof *entries;
+        if (entries[i].in_use)
+          {
+            strlcpy (name, entries[i].name, NAME_MAX + 1);
+            return true;
+          }
+      }
   return false;
 }
 
@@ -238,14 +460,18 @@ dir_is_empty (struct dir *dir)
 {
   ASSERT (dir->pos == DIR_OFFSET);
   
-  struct dir_entry e;
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
-    {
-      dir->pos += sizeof e;
-      if (e.in_use &&
-          strcmp (e.name, ".") != 0 &&
-          strcmp (e.name, "..") != 0)
-        return false;
-    }
+  struct dir_entry entries[DIR_BLOCK_ENTRIES];
+  size_t cnt;
+
+  while ((cnt = read_entries (dir, dir->pos, entries)) > 0)
+    for (size_t i = 0; i < cnt; i++)
+      {
+        struct dir_entry *e = &entries[i];
+        dir->pos += sizeof *e;
+        if (e->in_use &&
+            strcmp (e->name, ".") != 0 &&
+            strcmp (e->name, "..") != 0)
+          return false;
+      }
   return true;
 }
@@ -12,6 +12,11 @@
 /* Offset in a directory at which entries begin. */
 #define DIR_OFFSET (sizeof (struct dir_entry) * 2)
 
+/* Number of hash buckets of a new directory. Each bucket is
+   one sector of entries, and overflows into further sectors
+   appended to the directory. */
+#define DIR_BUCKET_CNT 64
+
 /* A directory. */
 struct dir 
   {
@@ -30,7 +35,7 @@ struct dir_entry
 struct inode;
 
 /* Opening and closing directories. */
-bool dir_create (block_sector_t sector, size_t entry_cnt);
+bool dir_create (block_sector_t sector, block_sector_t parent_sector);
 struct dir *dir_open (struct inode *);
 struct dir *dir_open_root (void);
 struct dir *dir_open_cwd (void);
@@ -39,6 +44,7 @@ void dir_close (struct dir *);
 struct inode *dir_get_inode (struct dir *);
 
 /* Reading and writing. */
+block_sector_t dir_lookup_sector (struct inode *, const char *name);
 bool dir_lookup (const struct dir *, const char *name, struct inode **);
 bool dir_add (struct dir *, const char *name, block_sector_t);
 bool dir_remove (struct dir *, const char *name);
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "filesys/cache.h"
+#include "filesys/dentry.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
@@ -27,37 +28,32 @@ filesys_init (bool format)
 
   cache_init ();
   inode_init ();
+  dentry_init ();
   free_map_init ();
 
   if (format) 
     do_format ();
 
   free_map_open ();
-  
-  /* Add default "." and ".." entries to root directory. */
-  if (format)
-    {
-      struct dir *dir = dir_open (inode_open (ROOT_DIR_SECTOR));
-      if (!dir_add (dir, ".", ROOT_DIR_SECTOR) ||
-          !dir_add (dir, "..", ROOT_DIR_SECTOR))
-        PANIC ("Adding default entries to root directory failed.");
-      dir_close (dir);
-    }
 
   thread_current ()->cwd_inode = inode_open (ROOT_DIR_SECTOR);
 }
 
-/* Shuts down the file system module, writing the free map
-   and any unwritten data to disk. */
+/* Shuts down the file system module, waiting for the blocks
+   of removed files to be freed and writing the free map
+   and any unwritten data to disk. The cache is flushed last,
+   since closing the free map writes it and its inode to the
+   cache. */
 void
 filesys_done (void) 
 {
-  free_map_flush ();
-  cache_flush ();
+  inode_done ();
   free_map_close ();
+  cache_flush ();
 }
 
-/* Creates a file named NAME with the given INITIAL_SIZE.
+/* Creates a file named NAME with the given INITIAL_SIZE,
+   which is ignored if TYPE is DIR.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
    or if internal memory allocation fails. */
@@ -95,27 +91,34 @@ filesys_create (const char *path, off_t initial_size, enum inode_type type)
       return false;
     }
   
-  /* Create new inode_disk and add dir_entry. */
+  /* Create new inode_disk near its parent directory and add
+     dir_entry. A new directory gets its current and parent
+     dir_entries from dir_create(). */
   block_sector_t new_inode_sector = 0;
   struct dir *parent_dir = dir_open (parent_inode);
-  bool success = (parent_dir != NULL
-                  && free_map_allocate (1, &new_inode_sector)
-                  && inode_create (new_inode_sector, initial_size, type)
-                  && dir_add (parent_dir, name, new_inode_sector));
-
-  /* If creating directory, add current and parent dir_entries. */
-  if (type == DIR)
+  bool allocated = (parent_dir != NULL
+                    && free_map_allocate_near (parent_inode->sector, 1,
+                                               &new_inode_sector));
+  bool created = (allocated
+                  && (type == DIR
+                      ? dir_create (new_inode_sector, parent_inode->sector)
+                      : inode_create (new_inode_sector, initial_size, type)));
+  bool success = created && dir_add (parent_dir, name, new_inode_sector);
+  
+  /* If creation failed, free what was allocated. A new inode
+     may already have data blocks, such as the header block of
+     a directory, so it is removed, and closing it frees its
+     blocks along with its sector. */
+  if (!success && created)
     {
-      struct dir *new_dir = dir_open (inode_open (new_inode_sector));
-      success = (success 
-                 && dir_add (new_dir, ".", new_inode_sector)
-                 && dir_add (new_dir, "..", parent_inode->sector));
-      dir_close (new_dir);
+      struct inode *new_inode = inode_open (new_inode_sector);
+      if (new_inode != NULL)
+        {
+          inode_remove (new_inode);
+          inode_close (new_inode);
+        }
     }
-  
-  /* If new directory creation at all failed, set allocated disk
-     block to free. */
-  if (!success || new_inode_sector == SECTOR_NOT_PRESENT) 
+  else if (!success && allocated)
     free_map_release (new_inode_sector, 1);
   
   lock_release (&parent_inode->lock);
@@ -225,7 +228,7 @@ do_format (void)
 {
   printf ("Formatting file system...");
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 16))
+  if (!dir_create (ROOT_DIR_SECTOR, ROOT_DIR_SECTOR))
     PANIC ("root directory creation failed");
   free_map_close ();
   printf ("done.\n");
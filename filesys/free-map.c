@@ -1,13 +1,31 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include <stdio.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Number of free map bits stored in one sector of the free
+   map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static size_t *group_free;           /* Free sectors in each group. */
+static size_t group_cnt;             /* Number of block groups. */
+static struct bitmap *dirty_map;     /* Sectors of the free map file
+                                        changed since last flush. */
+static struct lock free_map_lock;    /* Protects fields above. */
+static struct lock flush_lock;       /* Serializes free_map_flush(). */
+
+static void count_free (void);
+static void update_free (size_t sector, size_t cnt, bool allocated);
+static void mark_dirty (size_t sector, size_t cnt);
+static size_t scan_range (size_t start, size_t end, size_t cnt);
 
 /* Initializes the free map. */
 void
@@ -18,6 +36,16 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), FREE_MAP_GROUP_SIZE);
+  group_free = malloc (sizeof *group_free * group_cnt);
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                           BITS_PER_SECTOR));
+  if (group_free == NULL || dirty_map == NULL)
+    PANIC ("free map group allocation failed");
+  count_free ();
+  lock_init (&free_map_lock);
+  lock_init (&flush_lock);
 }
 
 /* Allocates CNT consecutive sectors from the free map and
@@ -27,11 +55,63 @@ free_map_init (void)
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+  return free_map_allocate_near (0, cnt, sectorp);
+}
+
+/* Allocates CNT consecutive sectors from the free map,
+   preferring the first run at or after sector GOAL, and
+   stores the first into *SECTORP. Returns true if
+   successful, false if not enough consecutive sectors
+   were available.
+
+   The block group of GOAL is searched from GOAL onward,
+   then the following groups in turn, wrapping around to
+   the start of GOAL's group. Groups with fewer than CNT
+   free sectors are skipped without looking at the bitmap,
+   or, if CNT is more than a group, groups with no free
+   sector at all, since such a run starts in one group and
+   fills the following ones. Only if that fails, which may
+   happen if the free sectors are fragmented across group
+   boundaries, is the whole bitmap scanned. */
+bool
+free_map_allocate_near (block_sector_t goal, size_t cnt,
+                        block_sector_t *sectorp)
+{
+  size_t sector = BITMAP_ERROR;
   ASSERT (free_map_file != NULL)
 
+  if (goal >= bitmap_size (free_map))
+    goal = 0;
+
+  lock_acquire (&free_map_lock);
+
+  size_t first = goal / FREE_MAP_GROUP_SIZE;
+  size_t need = cnt <= FREE_MAP_GROUP_SIZE ? cnt : 1;
+  for (size_t i = 0; i <= group_cnt && sector == BITMAP_ERROR; i++)
+    {
+      size_t group = (first + i) % group_cnt;
+      size_t start = group * FREE_MAP_GROUP_SIZE;
+      size_t end = start + FREE_MAP_GROUP_SIZE;
+      if (i == 0)
+        start = goal;
+      else if (i == group_cnt)
+        end = goal;
+
+      if (group_free[group] >= need)
+        sector = scan_range (start, end, cnt);
+    }
+  if (sector == BITMAP_ERROR)
+    sector = bitmap_scan (free_map, 0, cnt, false);
+
   if (sector != BITMAP_ERROR)
-    *sectorp = sector;
+    {
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      update_free (sector, cnt, true);
+      mark_dirty (sector, cnt);
+      *sectorp = sector;
+    }
+  lock_release (&free_map_lock);
+
   return sector != BITMAP_ERROR;
 }
 
@@ -39,8 +119,80 @@ free_map_allocate (size_t cnt, block_sector_t *sectorp)
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
+  update_free (sector, cnt, false);
+  mark_dirty (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Returns the first sector of a run of CNT free sectors that
+   starts in [START, END), or BITMAP_ERROR if there is none.
+   The run may extend past END. */
+static size_t
+scan_range (size_t start, size_t end, size_t cnt)
+{
+  size_t run = 0;
+
+  for (size_t sector = start; sector < bitmap_size (free_map); sector++)
+    {
+      if (run == 0 && sector >= end)
+        break;
+      if (bitmap_test (free_map, sector))
+        run = 0;
+      else if (++run == cnt)
+        return sector + 1 - cnt;
+    }
+
+  return BITMAP_ERROR;
+}
+
+/* Marks the sectors of the free map file that hold the bits
+   for the CNT sectors starting at SECTOR as dirty. */
+static void
+mark_dirty (size_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
+
+/* Recounts the free sectors of every block group. */
+static void
+count_free (void)
+{
+  size_t size = bitmap_size (free_map);
+
+  for (size_t group = 0; group < group_cnt; group++)
+    {
+      size_t start = group * FREE_MAP_GROUP_SIZE;
+      size_t cnt = size - start < FREE_MAP_GROUP_SIZE
+                   ? size - start : FREE_MAP_GROUP_SIZE;
+      group_free[group] = bitmap_count (free_map, start, cnt, false);
+    }
+}
+
+/* Updates the free sector counts of the block groups that
+   contain the CNT sectors starting at SECTOR, which were
+   just ALLOCATED or released. */
+static void
+update_free (size_t sector, size_t cnt, bool allocated)
+{
+  while (cnt > 0)
+    {
+      size_t group = sector / FREE_MAP_GROUP_SIZE;
+      size_t n = (group + 1) * FREE_MAP_GROUP_SIZE - sector;
+      if (n > cnt)
+        n = cnt;
+
+      if (allocated)
+        group_free[group] -= n;
+      else
+        group_free[group] += n;
+      sector += n;
+      cnt -= n;
+    }
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -52,13 +204,18 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  count_free ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_flush ();
+  lock_acquire (&flush_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&flush_lock);
 }
 
 /* Creates a new free map file on disk and writes the free
@@ -78,9 +235,25 @@ free_map_create (void)
     PANIC ("can't write free map");
 }
 
-/* Writes the free map to disk. */
+/* Writes the sectors of the free map that changed since the
+   last flush to the free map file, through the buffer cache.
+   The dirty mark of a sector is cleared before the sector is
+   written, so a change made during the write marks it dirty
+   again for the next flush. */
 void
 free_map_flush (void)
 {
-  bitmap_write (free_map, free_map_file);
+  lock_acquire (&flush_lock);
+  for (size_t idx = 0; free_map_file != NULL; idx++)
+    {
+      lock_acquire (&free_map_lock);
+      idx = bitmap_scan_and_flip (dirty_map, idx, 1, true);
+      lock_release (&free_map_lock);
+      if (idx == BITMAP_ERROR)
+        break;
+
+      bitmap_write_partial (free_map, free_map_file,
+                            idx * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+    }
+  lock_release (&flush_lock);
 }
@@ -5,6 +5,11 @@
 #include <stddef.h>
 #include "devices/block.h"
 
+/* Number of sectors in a block group. The free map keeps a
+   count of free sectors per group, so that allocation can
+   skip groups that are too full. */
+#define FREE_MAP_GROUP_SIZE 512
+
 void free_map_init (void);
 void free_map_read (void);
 void free_map_create (void);
@@ -12,6 +17,8 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (block_sector_t goal, size_t,
+                             block_sector_t *);
 void free_map_release (block_sector_t, size_t);
 void free_map_flush (void);
 
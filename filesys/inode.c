@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "filesys/cache.h"
+#include "filesys/dentry.h"
 #include "filesys/filesys.h"
 #include "filesys/directory.h"
 #include "filesys/free-map.h"
@@ -15,32 +16,112 @@
 #define INODE_MAGIC 0x494e4f44
 
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode`. */
-static struct list open_inodes;
+/* Table of open inodes, hashed by sector, so that opening a
+   single inode twice returns the same `struct inode`. */
+static struct hash open_inodes;
 
-/* Lock on open_inodes list. */
+/* Lock on open_inodes table and on the open_cnt of every
+   inode in it. */
 static struct lock open_inodes_lock;
 
-static void free_disk_block (block_sector_t sector);
-static bool add_new_block (struct inode_disk *i_data,
-                           block_sector_t sector, off_t ofs);
-static block_sector_t allocate_zeroed_block (struct inode_disk *inode_data, 
-                                             off_t offset);
-static bool zero_fill_gap (struct inode_disk *inode_data, off_t write_pos);
-static off_t extend_write (struct inode_disk *inode_data, off_t offset,
-                           const uint8_t *buffer, off_t size, 
-                           off_t bytes_written);
-static off_t normal_write (struct inode_disk *inode_data, block_sector_t sector,
-                           off_t offset, const uint8_t *buffer, off_t size, 
-                           off_t bytes_written, bool extend);
+/* Removed inodes whose last opener has closed them, waiting
+   for the reclaimer thread to free their blocks. */
+static struct list reclaim_list;
+
+/* Number of inodes queued in reclaim_list or being freed by
+   the reclaimer thread. */
+static size_t reclaim_pending;
+
+/* Protects the fields above. reclaim_cond is signaled when
+   an inode is queued, and reclaim_done when reclaim_pending
+   drops to 0. */
+static struct lock reclaim_lock;
+static struct condition reclaim_cond;
+static struct condition reclaim_done;
+
+static thread_func inode_reclaimer NO_RETURN;
+static bool inode_reclaim_wait (void);
+
+static hash_hash_func open_inode_hash;
+static hash_less_func open_inode_less;
+static struct inode *open_inode_find (block_sector_t sector);
+
+static bool extent_insert (struct inode *inode, size_t block,
+                           block_sector_t start, size_t len);
+static size_t inode_allocate (struct inode *inode, size_t block,
+                              size_t cnt, size_t prealloc);
+static void inode_trim (struct inode *inode);
+static void read_ahead (struct inode *inode, struct inode_disk *inode_data,
+                        off_t offset, off_t bytes_read);
+static bool inode_range_mapped (const struct inode_disk *inode_data,
+                                off_t start, off_t end);
+static void inode_write_disk (struct inode *inode);
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
   lock_init (&open_inodes_lock);
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, open_inode_hash, open_inode_less, NULL))
+    PANIC ("inode_init: failed memory allocation for open inode table.");
+
+  /* Spawn worker thread that frees the blocks of removed
+     inodes. */
+  list_init (&reclaim_list);
+  reclaim_pending = 0;
+  lock_init (&reclaim_lock);
+  cond_init (&reclaim_cond);
+  cond_init (&reclaim_done);
+  if (thread_create ("inode-reclaim", PRI_DEFAULT,
+                     inode_reclaimer, NULL) == TID_ERROR)
+    PANIC ("inode_init: failed to spawn inode reclaimer thread.");
+}
+
+/* Waits until the blocks of every removed inode have been
+   freed, so that the free map can be written out. */
+void
+inode_done (void)
+{
+  inode_reclaim_wait ();
+}
+
+/* Returns a hash value for inode E. */
+static unsigned
+open_inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_int (inode->sector);
+}
+
+/* Returns true if inode A precedes inode B. */
+static bool
+open_inode_less (const struct hash_elem *a_, const struct hash_elem *b_,
+                 void *aux UNUSED)
+{
+  const struct inode *a = hash_entry (a_, struct inode, elem);
+  const struct inode *b = hash_entry (b_, struct inode, elem);
+  return a->sector < b->sector;
+}
+
+/* Returns the open inode for SECTOR with a new reference to
+   it, or a null pointer if SECTOR is not open.
+   open_inodes_lock must be held. */
+static struct inode *
+open_inode_find (block_sector_t sector)
+{
+  ASSERT (lock_held_by_current_thread (&open_inodes_lock));
+
+  struct inode key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  if (e == NULL)
+    return NULL;
+
+  struct inode *inode = hash_entry (e, struct inode, elem);
+  inode->open_cnt++;
+  return inode;
 }
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -51,192 +132,579 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
+/* Returns the index among the CNT extents EXTENTS of the
+   extent that contains file block BLOCK, or of the first
+   extent that starts after BLOCK if no extent contains it. */
+static size_t
+extent_search (const struct extent *extents, size_t cnt, size_t block)
+{
+  size_t lo = 0;
+  size_t hi = cnt;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      const struct extent *e = &extents[mid];
+      if (block < e->block)
+        hi = mid;
+      else if (block >= e->block + e->len)
+        lo = mid + 1;
+      else
+        return mid;
+    }
+
+  return lo;
+}
+
+/* Returns the index among the CNT index entries EXTENTS of
+   the entry for the child node that covers file block BLOCK.
+   That is the last entry that starts at or before BLOCK, or
+   the first entry if there is none. */
+static size_t
+index_search (const struct extent *extents, size_t cnt, size_t block)
+{
+  size_t lo = 0;
+  size_t hi = cnt;
+
+  ASSERT (cnt > 0);
+
+  /* Find the first entry that starts after BLOCK. */
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (block < extents[mid].block)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return lo > 0 ? lo - 1 : 0;
+}
+
+/* Searches the extent tree of INODE_DATA for file block
+   BLOCK. Returns true and copies the extent that contains
+   BLOCK into *E if there is one, otherwise returns false.
+
+   If PREV is non-null, sets *PREV to the extent before BLOCK
+   in the same node, or sets its LEN to 0 if there is none.
+   If NEXT is non-null, sets *NEXT to a file block after
+   BLOCK such that no block between the end of the extent
+   that contains BLOCK, or BLOCK itself if it is not mapped,
+   and *NEXT is mapped, or to SIZE_MAX if no later block is
+   mapped.
+
+   The nodes below the root are read through the cache, one
+   per level, so the cost is bounded by the depth of the
+   tree. */
+static bool
+extent_find (const struct inode_disk *inode_data, size_t block,
+             struct extent *e, struct extent *prev, size_t *next)
+{
+  const struct extent *extents = inode_data->extents;
+  size_t cnt = inode_data->extent_cnt;
+  size_t next_block = SIZE_MAX;
+  void *node_block = NULL;
+
+  /* Descend to the lowest node that covers BLOCK. The index
+     entry after the one followed bounds the next mapped
+     block. */
+  for (size_t depth = inode_data->depth; depth > 0; depth--)
+    {
+      size_t idx = index_search (extents, cnt, block);
+      if (idx + 1 < cnt)
+        next_block = extents[idx + 1].block;
+
+      void *child_block = cache_get_block_shared (extents[idx].start, INODE);
+      if (node_block != NULL)
+        cache_shared_release (node_block);
+      node_block = child_block;
+
+      const struct extent_node *node = node_block;
+      extents = node->extents;
+      cnt = node->extent_cnt;
+    }
+
+  size_t idx = extent_search (extents, cnt, block);
+  bool found = idx < cnt && extents[idx].block <= block;
+  if (found && e != NULL)
+    *e = extents[idx];
+  if (prev != NULL)
+    {
+      if (idx > 0)
+        *prev = extents[idx - 1];
+      else
+        prev->len = 0;
+    }
+  if (next != NULL)
+    {
+      size_t next_idx = found ? idx + 1 : idx;
+      *next = next_idx < cnt ? extents[next_idx].block : next_block;
+    }
+
+  if (node_block != NULL)
+    cache_shared_release (node_block);
+  return found;
+}
+
 /* Returns the disk sector that contains byte offset POS
    within INODE. Returns SECTOR_NOT_PRESENT if INODE does
    not contain data for a byte at offset POS. */
 static block_sector_t
 byte_to_sector (const struct inode_disk *inode_data, off_t pos) 
 {
-  off_t inode_data_block_num = pos / BLOCK_SECTOR_SIZE;
+  size_t block = pos / BLOCK_SECTOR_SIZE;
+  struct extent e;
+
+  if (extent_find (inode_data, block, &e, NULL, NULL))
+    return e.start + (block - e.block);
+  return SECTOR_NOT_PRESENT;
+}
+
+/* Returns true if every file block holding a byte in
+   [START, END) within INODE is backed by a disk sector. */
+static bool
+inode_range_mapped (const struct inode_disk *inode_data, off_t start,
+                    off_t end)
+{
+  size_t block = start / BLOCK_SECTOR_SIZE;
+  size_t end_block = DIV_ROUND_UP (end, BLOCK_SECTOR_SIZE);
 
-  if (inode_data_block_num < NUM_DIRECT)
-    return inode_data->sectors[inode_data_block_num];
-  else if (inode_data_block_num < NUM_DIR_INDIR)
+  while (block < end_block)
     {
-      /* Get indirect block from cache. */
-      block_sector_t indir_sector = inode_data->sectors[INDIR];
-
-      /* Indirect block not yet allocated. */
-      if (indir_sector == SECTOR_NOT_PRESENT)
-        return SECTOR_NOT_PRESENT;
-
-      /* Load indirect block into cache. */
-      void *indir_block_addr = cache_get_block_shared (indir_sector, DATA);
-      struct indir_block *indir_block = (struct indir_block *) indir_block_addr;
-
-      /* Return sector number in indirect block. */
-      off_t indir_idx = inode_data_block_num - NUM_DIRECT;
-      block_sector_t sector = indir_block->sectors[indir_idx];
-      cache_shared_release (indir_block_addr);
-      return sector;
+      struct extent e;
+      if (!extent_find (inode_data, block, &e, NULL, NULL))
+        return false;
+      block = e.block + e.len;
     }
-  else if (inode_data_block_num < NUM_FILE_MAX)
+
+  return true;
+}
+
+/* Maps the LEN file blocks starting at file block BLOCK,
+   none of which may be mapped yet, to the LEN disk sectors
+   starting at START in the node with the *CNT extents
+   EXTENTS, which has room for MAX. Merges the new extent
+   with its neighbors if they are contiguous with it, both in
+   the file and on disk. Returns false if the node has no
+   room for another extent. */
+static bool
+extent_add (struct extent *extents, uint32_t *cnt, size_t max,
+            size_t block, block_sector_t start, size_t len)
+{
+  size_t idx = extent_search (extents, *cnt, block);
+  struct extent *prev = idx > 0 ? &extents[idx - 1] : NULL;
+  struct extent *next = idx < *cnt ? &extents[idx] : NULL;
+
+  ASSERT (next == NULL || block + len <= next->block);
+
+  /* Append to the previous extent, and possibly join it with
+     the next one. */
+  if (prev != NULL && prev->block + prev->len == block
+      && prev->start + prev->len == start)
     {
-      /* Get doubly indirect block from cache. */
-      block_sector_t d_indir_sector = inode_data->sectors[DOUBLE_INDIR];
+      prev->len += len;
+      if (next != NULL && prev->block + prev->len == next->block
+          && prev->start + prev->len == next->start)
+        {
+          prev->len += next->len;
+          memmove (next, next + 1, (*cnt - idx - 1) * sizeof *next);
+          (*cnt)--;
+        }
+      return true;
+    }
 
-      /* Doubly indirect block not yet allocated. */
-      if (d_indir_sector == SECTOR_NOT_PRESENT)
-        return SECTOR_NOT_PRESENT;
+  /* Prepend to the next extent. */
+  if (next != NULL && block + len == next->block
+      && start + len == next->start)
+    {
+      next->block = block;
+      next->start = start;
+      next->len += len;
+      return true;
+    }
 
-      void *d_indir_block_addr = cache_get_block_shared (d_indir_sector, DATA);
-      struct indir_block *d_indir_block = 
-        (struct indir_block *) d_indir_block_addr;
+  /* Insert a new extent, keeping extents sorted by file block. */
+  if (*cnt >= max)
+    return false;
+  memmove (&extents[idx + 1], &extents[idx], (*cnt - idx) * sizeof *next);
+  extents[idx].block = block;
+  extents[idx].start = start;
+  extents[idx].len = len;
+  (*cnt)++;
+  return true;
+}
 
-      /* Get correct indirect block in doubly indirect block. */
-      off_t d_indir_idx = (inode_data_block_num - NUM_DIR_INDIR) / NUM_INDIRECT;
-      block_sector_t indir_sector = d_indir_block->sectors[d_indir_idx];
-      cache_shared_release (d_indir_block_addr);
+/* Adds a level to the extent tree of INODE by moving the
+   entries of the full root into a new node, which becomes
+   the only child of the root. Returns false if no sector is
+   free for the new node. */
+static bool
+extent_grow (struct inode *inode)
+{
+  struct inode_disk *inode_data = &inode->data;
+  block_sector_t sector;
 
-      /* Indirect block in doubly indirect block not yet allocated. */
-      if (indir_sector == SECTOR_NOT_PRESENT)
-        return SECTOR_NOT_PRESENT;
+  if (!free_map_allocate_near (inode->sector + 1, 1, &sector))
+    return false;
 
-      void *indir_block_addr = cache_get_block_shared (indir_sector, DATA);
-      struct indir_block *indir_block = (struct indir_block *) indir_block_addr;
+  struct extent_node *node = cache_get_block_zeroed (sector, INODE);
+  node->extent_cnt = inode_data->extent_cnt;
+  memcpy (node->extents, inode_data->extents,
+          inode_data->extent_cnt * sizeof *node->extents);
+  cache_exclusive_release (node);
 
-      off_t indir_idx = (inode_data_block_num - NUM_DIR_INDIR) % NUM_INDIRECT;
-      block_sector_t sector = indir_block->sectors[indir_idx];
-      cache_shared_release (indir_block_addr);
+  inode_data->extents[0].start = sector;
+  inode_data->extents[0].len = 0;
+  inode_data->extent_cnt = 1;
+  inode_data->depth++;
+  return true;
+}
 
-      return sector;
-    }
-  else
-    return SECTOR_NOT_PRESENT;
-}
-
-/* Adds the sector number SECTOR of a newly allocated disk
-   block to the inode_disk I_DATA of a file at an index
-   calculated from offset OFS. Allocate indirect blocks
-   and doubly indirect blocks as needed to contain the new
-   sector entry. Returns true if operation is successful
-   and false otherwise. 
-   
-   At function entry, the rw_lock for the inode_disk is
-   held in exclusive_acquire mode. At function exit, this
-   rw_lock is still held in exclusive_acquire mode. All
-   other acquired locks must also beproperly released
-   before function exit. */
+/* Splits the full node CHILD, to which index entry IDX of
+   the *CNT entries EXTENTS refers, by moving the upper half
+   of its entries into a new node and adding an index entry
+   for the new node after entry IDX. EXTENTS must have room
+   for another entry. Returns false if no sector is free for
+   the new node. */
 static bool
-add_new_block (struct inode_disk *inode_data, block_sector_t sector, off_t ofs)
+extent_split (struct extent *extents, uint32_t *cnt, size_t idx,
+              struct extent_node *child)
 {
-  off_t ofs_block_num = ofs / BLOCK_SECTOR_SIZE;
+  block_sector_t sector;
+
+  if (!free_map_allocate_near (extents[idx].start, 1, &sector))
+    return false;
 
-  bool new_indir = false;
-  bool new_double_indir = false;
-  bool new_double_indir_indir = false;
+  struct extent_node *sibling = cache_get_block_zeroed (sector, INODE);
+  size_t half = child->extent_cnt / 2;
+  sibling->extent_cnt = child->extent_cnt - half;
+  memcpy (sibling->extents, child->extents + half,
+          sibling->extent_cnt * sizeof *sibling->extents);
+  child->extent_cnt = half;
+  cache_mark_dirty (child);
+
+  memmove (&extents[idx + 2], &extents[idx + 1],
+           (*cnt - idx - 1) * sizeof *extents);
+  extents[idx + 1].block = sibling->extents[0].block;
+  extents[idx + 1].start = sector;
+  extents[idx + 1].len = 0;
+  (*cnt)++;
+  cache_exclusive_release (sibling);
+  return true;
+}
+
+/* Maps the LEN file blocks starting at file block BLOCK,
+   none of which may be mapped yet, to the LEN disk sectors
+   starting at START in the extent tree of INODE. The blocks
+   must not run into the next mapped block that extent_find()
+   reports for BLOCK.
+
+   Full nodes on the way down from the root are split before
+   they are entered, and a full root first moves its entries
+   down into a new level, so every node that an entry is
+   added to has room for it. Returns false if no sector is
+   free for a new node.
+
+   The rw_lock of INODE must be held in exclusive_acquire
+   mode. The caller writes the inode_disk copy of INODE
+   through to the cache. */
+static bool
+extent_insert (struct inode *inode, size_t block, block_sector_t start,
+               size_t len)
+{
+  struct inode_disk *inode_data = &inode->data;
 
-  /* Out of space in file. */
-  if (ofs_block_num >= NUM_FILE_MAX)
+  if (inode_data->extent_cnt == INODE_EXTENTS && !extent_grow (inode))
     return false;
 
-  /* Sector entry belongs in the direct block (inode_disk). */
-  if (ofs_block_num < NUM_DIRECT)
+  struct extent *extents = inode_data->extents;
+  uint32_t *cnt = &inode_data->extent_cnt;
+  size_t max = INODE_EXTENTS;
+  struct extent_node *node = NULL;
+  bool dirty = false;
+  bool success = true;
+
+  for (size_t depth = inode_data->depth; depth > 0 && success; depth--)
     {
-      inode_data->sectors[ofs_block_num] = sector;
-      return true;
+      /* Keep the index entry's block at or below every block
+         its child covers. */
+      size_t idx = index_search (extents, *cnt, block);
+      if (block < extents[idx].block)
+        {
+          extents[idx].block = block;
+          dirty = true;
+        }
+
+      struct extent_node *child =
+        cache_get_block_shared (extents[idx].start, INODE);
+      if (child->extent_cnt == EXTENT_NODE_EXTENTS)
+        {
+          success = extent_split (extents, cnt, idx, child);
+          dirty = dirty || success;
+          if (success && block >= extents[idx + 1].block)
+            {
+              cache_shared_release (child);
+              child = cache_get_block_shared (extents[idx + 1].start, INODE);
+            }
+        }
+
+      if (node != NULL)
+        {
+          if (dirty)
+            cache_mark_dirty (node);
+          cache_shared_release (node);
+        }
+      node = child;
+      dirty = false;
+      extents = node->extents;
+      cnt = &node->extent_cnt;
+      max = EXTENT_NODE_EXTENTS;
+    }
+
+  if (success)
+    {
+      success = extent_add (extents, cnt, max, block, start, len);
+      ASSERT (success);
+      dirty = true;
+    }
+  if (node != NULL)
+    {
+      if (dirty)
+        cache_mark_dirty (node);
+      cache_shared_release (node);
     }
-  /* Sector entry belongs in the indirect block. */
-  else if (ofs_block_num < NUM_DIR_INDIR)
+  return success;
+}
+
+/* Frees the CNT entries EXTENTS of an extent tree node that
+   is DEPTH levels above the lowest, along with the sectors
+   that they map and the nodes below them. The freed sectors
+   are discarded from the cache without being written back
+   to disk. */
+static void
+extent_free (const struct extent *extents, size_t cnt, size_t depth)
+{
+  for (size_t idx = 0; idx < cnt; idx++)
     {
-      /* Need to allocate indirect block for sector entry. */
-      if (inode_data->sectors[INDIR] == SECTOR_NOT_PRESENT)
+      const struct extent *e = &extents[idx];
+      if (depth == 0)
+        {
+          for (size_t ofs = 0; ofs < e->len; ofs++)
+            cache_free_slot (e->start + ofs);
+          free_map_release (e->start, e->len);
+        }
+      else
         {
-          block_sector_t i_sector = 0;
-          if (!free_map_allocate (1, &i_sector))
-            return false;
+          struct extent_node *node = cache_get_block_shared (e->start, INODE);
+          extent_free (node->extents, node->extent_cnt, depth - 1);
+          cache_discard (node);
+          free_map_release (e->start, 1);
+        }
+    }
+}
+
+/* Worker thread that frees the blocks of removed inodes
+   queued by inode_close(). Each time it wakes up, it takes
+   every queued inode at once and frees them as a batch,
+   along with their inode_disk sectors. The freed sectors are
+   discarded from the cache without being written back to
+   disk. */
+static void
+inode_reclaimer (void *aux UNUSED)
+{
+  struct list batch;
+  list_init (&batch);
 
-          inode_data->sectors[INDIR] = i_sector;
-          new_indir = true;
+  while (true)
+    {
+      lock_acquire (&reclaim_lock);
+      while (list_empty (&reclaim_list))
+        cond_wait (&reclaim_cond, &reclaim_lock);
+      while (!list_empty (&reclaim_list))
+        list_push_back (&batch, list_pop_front (&reclaim_list));
+      lock_release (&reclaim_lock);
+
+      size_t cnt = 0;
+      while (!list_empty (&batch))
+        {
+          struct inode *inode = list_entry (list_pop_front (&batch),
+                                            struct inode, reclaim_elem);
+          struct inode_disk *inode_data = &inode->data;
+
+          extent_free (inode_data->extents, inode_data->extent_cnt,
+                       inode_data->depth);
+
+          /* Entries cached for a directory, including "." and
+             "..", must not outlive its sector. */
+          if (inode->type == DIR)
+            dentry_invalidate_dir (inode->sector);
+          cache_free_slot (inode->sector);
+          free_map_release (inode->sector, 1);
+          free (inode);
+          cnt++;
         }
 
-      /* Get indirect block from cache. */
-      block_sector_t i_sector = inode_data->sectors[INDIR];
-      void *i_block_addr = cache_get_block_exclusive (i_sector, DATA);
-      struct indir_block *i_block = (struct indir_block *) i_block_addr;
+      lock_acquire (&reclaim_lock);
+      reclaim_pending -= cnt;
+      if (reclaim_pending == 0)
+        cond_broadcast (&reclaim_done, &reclaim_lock);
+      lock_release (&reclaim_lock);
+    }
+}
 
-      /* Set default values for indirect block if new. */
-      if (new_indir)
-        for (size_t idx = 0; idx < NUM_INDIRECT; idx++)
-          i_block->sectors[idx] = SECTOR_NOT_PRESENT;
+/* Waits until the reclaimer thread has freed the blocks of
+   every removed inode queued so far. Returns true if there
+   were any to wait for, false otherwise. */
+static bool
+inode_reclaim_wait (void)
+{
+  lock_acquire (&reclaim_lock);
+  bool pending = reclaim_pending > 0;
+  while (reclaim_pending > 0)
+    cond_wait (&reclaim_done, &reclaim_lock);
+  lock_release (&reclaim_lock);
 
-      i_block->sectors[ofs_block_num - NUM_DIRECT] = sector;
-      cache_exclusive_release (i_block_addr);
-      return true;
+  return pending;
+}
+
+/* Writes the inode_disk copy of INODE through to its sector
+   in the cache. The rw_lock of INODE must be held in
+   exclusive_acquire mode. */
+static void
+inode_write_disk (struct inode *inode)
+{
+  void *inode_block_addr = cache_get_block_exclusive (inode->sector, INODE);
+  memcpy (inode_block_addr, &inode->data, BLOCK_SECTOR_SIZE);
+  cache_mark_dirty (inode_block_addr);
+  cache_exclusive_release (inode_block_addr);
+}
+
+/* Allocates disk sectors for file block BLOCK of INODE,
+   which is not mapped, and for up to CNT - 1 + PREALLOC
+   unmapped file blocks that follow it, as one contiguous run
+   of sectors. The run is placed right after the sectors of
+   the preceding extent if possible, or right after the
+   inode's own sector for the first extent, so that the file
+   stays contiguous on disk and close to its inode. If no
+   run that long is free, shorter runs are tried.
+
+   Returns the number of file blocks that were mapped, which
+   may be less than CNT, or 0 if no sector could be
+   allocated. The contents of the new sectors are undefined.
+
+   The rw_lock of INODE must be held in exclusive_acquire
+   mode. The caller must write the inode_disk copy of INODE
+   through to the cache with inode_write_disk(). */
+static size_t
+inode_allocate (struct inode *inode, size_t block, size_t cnt,
+                size_t prealloc)
+{
+  block_sector_t goal = inode->sector + 1;
+  size_t want = cnt + prealloc;
+  struct extent prev;
+  size_t next;
+
+  extent_find (&inode->data, block, NULL, &prev, &next);
+
+  /* Don't run into the next extent. */
+  if (next - block < want)
+    want = next - block;
+
+  /* Keep the file's blocks at the same distance on disk as in
+     the file, relative to the preceding extent. */
+  if (prev.len > 0)
+    goal = prev.start + (block - prev.block);
+
+  /* If the disk is full, the sectors of removed files may
+     still be waiting for the reclaimer thread, so wait for it
+     and try again. */
+  do
+    {
+      for (size_t len = want; len > 0; len /= 2)
+        {
+          block_sector_t start;
+          if (!free_map_allocate_near (goal, len, &start))
+            continue;
+
+          if (!extent_insert (inode, block, start, len))
+            {
+              free_map_release (start, len);
+              return 0;
+            }
+          return len;
+        }
     }
-  /* Sector belongs to doubly indirect block. */
-  else
-   {
-     if (inode_data->sectors[DOUBLE_INDIR] == SECTOR_NOT_PRESENT)
-      {
-        block_sector_t di_sector = 0;
-        if (!free_map_allocate (1, &di_sector))
-          return false;
-
-        inode_data->sectors[DOUBLE_INDIR] = di_sector;
-        new_double_indir = true;
-      }
-
-    /* Get doubly indirect block from cache. */
-    block_sector_t di_sector = inode_data->sectors[DOUBLE_INDIR];
-    void *di_block_addr = cache_get_block_exclusive (di_sector, DATA);
-    struct indir_block *di_block = (struct indir_block *) di_block_addr;
-
-    /* Set default values for doubly indirect block if new. */
-    if (new_double_indir)
-      for (size_t idx = 0; idx < NUM_INDIRECT; idx++)
-        di_block->sectors[idx] = SECTOR_NOT_PRESENT;
-    
-    /* Determine placement of sector in the appropriate 
-      indirect block of the doubly indirect block. */
-    off_t ofs_di = ofs_block_num - NUM_DIR_INDIR;
-    off_t ofs_di_idx = ofs_di / NUM_INDIRECT;
-
-    /* Need to allocate new indirect block in doubly indirect block. */
-    if (di_block->sectors[ofs_di_idx] == SECTOR_NOT_PRESENT)
-      {
-        block_sector_t dii_sector = 0;
-        if (!free_map_allocate (1, &dii_sector))
-          {
-            cache_exclusive_release (di_block_addr);
-            return false;
-          }
-        
-        di_block->sectors[ofs_di_idx] = dii_sector;
-        new_double_indir_indir = true;
-      }
-
-    /* Get indirect block in doubly indirect block from cache. */
-    block_sector_t dii_sector = di_block->sectors[ofs_di_idx];
-    cache_exclusive_release (di_block_addr);
-
-    void *dii_block_addr = cache_get_block_exclusive (dii_sector, DATA);
-    struct indir_block *dii_block = (struct indir_block *) dii_block_addr;
-
-    /* Set default values for indirect block if new. */
-    if (new_double_indir_indir)
-      for (size_t idx = 0; idx < NUM_INDIRECT; idx++)
-        dii_block->sectors[idx] = SECTOR_NOT_PRESENT;
-
-    dii_block->sectors[ofs_di % NUM_INDIRECT] = sector;
-    cache_exclusive_release (dii_block_addr);
-    return true;
-  }
-}
-
-/* Initializes an inode with length LENGTH of uninitialized
-   data and writes the new inode to sector SECTOR on the
-   file system device.
+  while (inode_reclaim_wait ());
+
+  return 0;
+}
+
+/* Releases the sectors that INODE has preallocated past the
+   end of the file. Blocks past the end of file are only
+   ever mapped by preallocation, so they hold no data and
+   are all in the last node of the lowest level of the
+   extent tree. Called when the last opener is about to
+   close INODE, so that the preallocations of files that are
+   no longer growing do not waste disk space. */
+static void
+inode_trim (struct inode *inode)
+{
+  struct inode_disk *inode_data = &inode->data;
+  struct extent *extents = inode_data->extents;
+  uint32_t *cnt = &inode_data->extent_cnt;
+  struct extent_node *node = NULL;
+  bool trimmed = false;
+
+  rw_lock_exclusive_acquire (&inode->rw_lock);
+
+  /* Descend to the last node of the lowest level. */
+  for (size_t depth = inode_data->depth; depth > 0; depth--)
+    {
+      struct extent_node *child =
+        cache_get_block_shared (extents[*cnt - 1].start, INODE);
+      if (node != NULL)
+        cache_shared_release (node);
+      node = child;
+      extents = node->extents;
+      cnt = &node->extent_cnt;
+    }
+
+  size_t end = bytes_to_sectors (inode_data->length);
+  while (*cnt > 0)
+    {
+      struct extent *e = &extents[*cnt - 1];
+      if (e->block + e->len <= end)
+        break;
+
+      /* Free the blocks of the last extent past the end of
+         file, dropping the extent if none remain. */
+      size_t keep = e->block < end ? end - e->block : 0;
+      for (size_t ofs = keep; ofs < e->len; ofs++)
+        cache_free_slot (e->start + ofs);
+      free_map_release (e->start + keep, e->len - keep);
+      trimmed = true;
+
+      e->len = keep;
+      if (keep > 0)
+        break;
+      (*cnt)--;
+    }
+
+  if (node != NULL)
+    {
+      if (trimmed)
+        cache_mark_dirty (node);
+      cache_shared_release (node);
+    }
+  else if (trimmed)
+    inode_write_disk (inode);
+  rw_lock_exclusive_release (&inode->rw_lock);
+}
+
+/* Initializes an inode with length LENGTH of zeros and
+   writes the new inode to sector SECTOR on the file system
+   device. The file is created sparse: no data blocks are
+   allocated until they are first written.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool
@@ -254,9 +722,8 @@ inode_create (block_sector_t sector, off_t length, enum inode_type type)
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
       disk_inode->type = type;
-      
-      for (size_t idx = 0; idx < INODE_SECTORS; idx++)
-        disk_inode->sectors[idx] = SECTOR_NOT_PRESENT;
+      disk_inode->extent_cnt = 0;
+      disk_inode->depth = 0;
 
       /* Put new inode_disk on disk. */
       block_write (fs_device, sector, disk_inode);
@@ -274,20 +741,14 @@ inode_create (block_sector_t sector, off_t length, enum inode_type type)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
   struct inode *inode;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
-    }
+  lock_acquire (&open_inodes_lock);
+  inode = open_inode_find (sector);
+  lock_release (&open_inodes_lock);
+  if (inode != NULL)
+    return inode;
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
@@ -300,18 +761,30 @@ inode_open (block_sector_t sector)
   inode->deny_write_cnt = 0;
   inode->removed = false;
   lock_init (&inode->lock);
+  inode->ra_next = 0;
+  inode->ra_window = 0;
+  inode->ra_end = 0;
+  rw_lock_init (&inode->rw_lock);
 
-  /* Set inode type to type on type already set on inode_disk.
-     When adding new inodes, we always create inode_disk before
-     in-memory inode. */
+  /* Copy the inode_disk, which is always created before the
+     in-memory inode, and take the inode type from it. */
   void *inode_block_addr = cache_get_block_shared (inode->sector, INODE);
-  struct inode_disk *inode_data = (struct inode_disk *) inode_block_addr;
-  inode->type = inode_data->type;
+  memcpy (&inode->data, inode_block_addr, BLOCK_SECTOR_SIZE);
   cache_shared_release (inode_block_addr);
+  inode->type = inode->data.type;
 
+  /* Another process may have opened the inode while the
+     inode_disk was read, in which case its inode is used. */
   lock_acquire (&open_inodes_lock);
-  list_push_front (&open_inodes, &inode->elem);
+  struct inode *open_inode = open_inode_find (sector);
+  if (open_inode == NULL)
+    hash_insert (&open_inodes, &inode->elem);
   lock_release (&open_inodes_lock);
+  if (open_inode != NULL)
+    {
+      free (inode);
+      inode = open_inode;
+    }
 
   return inode;
 }
@@ -322,9 +795,9 @@ inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
     {
-      bool release = lock_acquire_in_context (&inode->lock);
+      lock_acquire (&open_inodes_lock);
       inode->open_cnt++;
-      lock_conditional_release (&inode->lock, release);
+      lock_release (&open_inodes_lock);
     }
     
   return inode;
@@ -339,7 +812,8 @@ inode_get_inumber (const struct inode *inode)
 
 /* Closes INODE and writes it to disk.
    If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+   If INODE was also a removed inode, queues it for the
+   reclaimer thread, which frees its blocks and memory. */
 void
 inode_close (struct inode *inode) 
 {
@@ -349,113 +823,44 @@ inode_close (struct inode *inode)
 
   bool release = lock_acquire_in_context (&inode->lock);
 
+  /* Trim preallocated blocks before dropping what is probably
+     the last reference. Once INODE has left the open inode
+     table, a new opener would read a stale inode_disk. */
+  if (inode->open_cnt == 1 && !inode->removed)
+    inode_trim (inode);
+
+  /* Drop the reference and, if it was the last one, remove
+     INODE from the open inode table while still holding
+     open_inodes_lock, so that inode_open() can never find an
+     inode that is about to be freed. */
+  lock_acquire (&open_inodes_lock);
+  bool last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      lock_acquire (&open_inodes_lock);
-      list_remove (&inode->elem);
-      lock_release (&open_inodes_lock);
- 
-      /* Deallocate blocks if removed. */
+      /* Hand a removed inode to the reclaimer thread, which
+         frees its blocks and then INODE itself, so that closing
+         a large file takes no longer than closing a small one. */
       if (inode->removed) 
         {
-          /* Get inode_disk block from cache. */
-          void *inode_block_addr = 
-            cache_get_block_exclusive (inode->sector, INODE);
-          struct inode_disk *inode_data = 
-            (struct inode_disk *) inode_block_addr;
-
-          /* Free data blocks pointed to by direct block (inode_disk). */
-          for (size_t idx = 0; idx < NUM_DIRECT; idx++)
-            {
-              block_sector_t sector = inode_data->sectors[idx];
-              if (sector != SECTOR_NOT_PRESENT)
-                free_disk_block (sector);
-            }
-
-          /* Free data blocks pointed to by indirect block. */
-          if (inode_data->sectors[INDIR] != SECTOR_NOT_PRESENT)
-            {
-              /* Get indirect block from cache. */
-              block_sector_t i_sector = inode_data->sectors[INDIR];
-              void *i_block_addr = cache_get_block_exclusive (i_sector, DATA);
-              struct indir_block *i_block = (struct indir_block *) i_block_addr;
-
-              for (size_t idx = 0; idx < NUM_INDIRECT; idx++)
-                {
-                  block_sector_t sector = i_block->sectors[idx];
-                  if (sector != SECTOR_NOT_PRESENT)
-                    free_disk_block (sector);
-                }
-              
-              /* Free the indirect block. */
-              cache_exclusive_release (i_block_addr);
-              free_disk_block (i_sector);
-            }
-         
-          /* Free data blocks pointed to by doubly indirect block. */
-          if (inode_data->sectors[DOUBLE_INDIR] != SECTOR_NOT_PRESENT)
-            {
-              /* Get doubly indirect block from cache. */
-              block_sector_t di_sector = inode_data->sectors[DOUBLE_INDIR];
-              void *di_block_addr = cache_get_block_exclusive (di_sector, DATA);
-              struct indir_block *di_block = 
-                (struct indir_block *) di_block_addr;
-
-              /* Iterate through indirect blocks of doubly indirect block. */
-              for (size_t d_idx = 0; d_idx < NUM_INDIRECT; d_idx++)
-                {
-                  if (di_block->sectors[d_idx] == SECTOR_NOT_PRESENT)
-                    continue;
-                    
-                  /* Get indirect block from cache. */
-                  block_sector_t dii_sector = di_block->sectors[d_idx];
-                  void *dii_block_addr = 
-                    cache_get_block_exclusive (dii_sector, DATA);
-                  struct indir_block *dii_block = 
-                    (struct indir_block *) dii_block_addr;
-
-                  /* Free data blocks pointed to by indirect block. */
-                  for (size_t idx = 0; idx < NUM_INDIRECT; idx++)
-                    {
-                      block_sector_t sector = dii_block->sectors[idx];
-                      if (sector != SECTOR_NOT_PRESENT)
-                        free_disk_block (sector);
-                    }
-                  
-                  /* Free the indirect block. */
-                  cache_exclusive_release (dii_block_addr);
-                  free_disk_block (dii_sector);
-                }
-            
-              /* Free the doubly indirect block. */
-              cache_exclusive_release (di_block_addr);
-              free_disk_block (di_sector);
-            }
-
-          /* Free the direct block (inode_disk). */
-          cache_exclusive_release (inode_data);
-          free_disk_block (inode->sector);
+          lock_conditional_release (&inode->lock, release);
+          lock_acquire (&reclaim_lock);
+          list_push_back (&reclaim_list, &inode->reclaim_elem);
+          reclaim_pending++;
+          cond_signal (&reclaim_cond, &reclaim_lock);
+          lock_release (&reclaim_lock);
         }
-
-      free (inode); 
+      else
+        free (inode); 
     }
   else 
     lock_conditional_release (&inode->lock, release);
 }
 
-/* Frees the cache slot corresponding to CACHE_IDX and
-   frees the disk sector corresponding to SECTOR. */
-static void
-free_disk_block (block_sector_t sector)
-{
-  ASSERT (sector != SECTOR_NOT_PRESENT);
-  
-  cache_free_slot (sector);
-  free_map_release (sector, 1);
-}
-
 /* Marks INODE to be deleted when it is closed by the last
    caller who has it open. */
 void
@@ -472,47 +877,29 @@ inode_remove (struct inode *inode)
 /* Reads SIZE bytes from INODE into BUFFER, starting at
    position OFFSET. Returns the number of bytes actually
    read, which may be less than SIZE if an error occurs
-   or end of file is reached. */
+   or end of file is reached. Blocks within the file that
+   were never written are holes and read as zeros. */
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
+  off_t start = offset;
   
-  void *inode_block_addr = cache_get_block_shared (inode->sector, INODE);
-  struct inode_disk *inode_data = (struct inode_disk *) inode_block_addr;
+  rw_lock_shared_acquire (&inode->rw_lock);
+  struct inode_disk *inode_data = &inode->data;
   off_t length = inode_data->length;
 
   while (size > 0) 
     {
-      /* Offset is past end of file, so return zero bytes read. */
+      /* Offset is past end of file, so no more bytes to read. */
       if (offset >= length)
-        {
-          cache_shared_release (inode_block_addr);
-          return bytes_read;
-        }
+        break;
 
       /* Disk sector to read, starting byte offset within sector. */
       block_sector_t sector_idx = byte_to_sector (inode_data, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Offset is in file but there is no corresponding sector,
-         which means that we now need to explicitly allocate a
-         zero block at this offset in the file. */
-      if (sector_idx == SECTOR_NOT_PRESENT && offset < length)
-        {
-          block_sector_t new_sector = 
-            allocate_zeroed_block (inode_data, offset);
-          if (new_sector == SECTOR_NOT_PRESENT)
-            {
-              cache_shared_release (inode_block_addr);
-              return bytes_read;
-            }
-
-          /* Update sector_idx to the newly allocated block of zeros. */
-          sector_idx = new_sector;
-        }
-
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
       off_t inode_left = length - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
@@ -521,59 +908,89 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       /* Number of bytes to actually copy out of this sector. */
       int chunk = size < min_left ? size : min_left;
       if (chunk == 0)
+        break;
+
+      /* Read full or partial block of data. Offset is in file
+         but there is no corresponding sector, so it lies in a
+         hole, which reads as zeros without allocating a block. */
+      if (sector_idx == SECTOR_NOT_PRESENT)
+        memset (buffer + bytes_read, 0, chunk);
+      else
         {
-          cache_shared_release (inode_block_addr);
-          return bytes_read;
+          void *cache_block_addr = cache_get_block_shared (sector_idx, DATA);
+          memcpy (buffer + bytes_read, cache_block_addr + sector_ofs, chunk);
+          cache_shared_release (cache_block_addr);
         }
-
-      /* Read full or partial block of data. */
-      void *cache_block_addr = cache_get_block_shared (sector_idx, DATA);
-      memcpy (buffer + bytes_read, cache_block_addr + sector_ofs, chunk);
-      cache_shared_release (cache_block_addr);
       
       /* Advance. */
       size -= chunk;
       offset += chunk;
       bytes_read += chunk;
-
-      /* Read-ahead and load the next data block into the
-         cache asynchronously if there is one. */
-      if (size > 0)
-        {
-          block_sector_t next_sector = byte_to_sector (inode_data, offset);
-          if (next_sector != SECTOR_NOT_PRESENT)
-            read_ahead_signal (next_sector);
-        }
     }
   
-  cache_shared_release (inode_block_addr);
+  read_ahead (inode, inode_data, start, bytes_read);
+  rw_lock_shared_release (&inode->rw_lock);
   return bytes_read;
 }
 
-/* Called when inode_read_at is called at in-file location
-   with no corresponding block sector allocated yet. Allocates
-   zeroed block, adds to inode_disk of INODE. */
-static block_sector_t
-allocate_zeroed_block (struct inode_disk *inode_data, off_t offset)
+/* Called at the end of inode_read_at() after BYTES_READ bytes
+   were read from INODE starting at OFFSET. Detects sequential
+   access and asynchronously loads the data blocks ahead of
+   the reader into the cache.
+
+   A read that starts where the previous read ended doubles
+   the read-ahead window, up to READ_AHEAD_MAX sectors, and a
+   read from the beginning of the file restarts it at
+   READ_AHEAD_MIN sectors. Any other read collapses the
+   window, so random access triggers no read-ahead. Only the
+   blocks past what was already read ahead are submitted, as
+   a single batch. INODE_DATA is the inode_disk copy of
+   INODE, whose rw_lock is held in shared_acquire mode.
+
+   The read-ahead state is only a hint, so races between
+   concurrent readers of INODE are harmless. */
+static void
+read_ahead (struct inode *inode, struct inode_disk *inode_data,
+            off_t offset, off_t bytes_read)
 {
-  /* Allocate a new disk sector. */
-  block_sector_t new_sector = 0;
-  if (!free_map_allocate (1, &new_sector))
-    return SECTOR_NOT_PRESENT;
+  block_sector_t sectors[READ_AHEAD_MAX];
+  size_t sector_cnt = 0;
 
-  /* Write full block of zeros to the new sector. */
-  void *new_block_addr = cache_get_block_exclusive (new_sector, DATA);
-  memset (new_block_addr, 0, BLOCK_SECTOR_SIZE);
-  cache_exclusive_release (new_block_addr);
-
-  /* Write new sector number to inode_disk. */
-  if (!add_new_block (inode_data, new_sector, offset))
+  if (offset != 0 && offset == inode->ra_next)
+    {
+      if (inode->ra_window < READ_AHEAD_MIN)
+        inode->ra_window = READ_AHEAD_MIN;
+      else if (inode->ra_window < READ_AHEAD_MAX)
+        inode->ra_window *= 2;
+    }
+  else
     {
-      free_map_release (new_sector, 1);
-      return -1;
+      inode->ra_window = offset == 0 ? READ_AHEAD_MIN : 0;
+      inode->ra_end = 0;
     }
+  inode->ra_next = offset + bytes_read;
+
+  /* File blocks in the window, excluding the block the read
+     ended in, which is already in the cache. */
+  size_t first_block = DIV_ROUND_UP (inode->ra_next, BLOCK_SECTOR_SIZE);
+  size_t last_block = bytes_to_sectors (inode_data->length);
+  if (last_block > first_block + inode->ra_window)
+    last_block = first_block + inode->ra_window;
+  if (first_block < inode->ra_end)
+    first_block = inode->ra_end;
+
+  for (size_t block = first_block; block < last_block; block++)
+    {
+      block_sector_t sector = byte_to_sector (inode_data,
+                                              block * BLOCK_SECTOR_SIZE);
+      if (sector != SECTOR_NOT_PRESENT)
+        sectors[sector_cnt++] = sector;
+    }
+  if (last_block > inode->ra_end)
+    inode->ra_end = last_block;
 
-  return new_sector;
+  if (sector_cnt > 0)
+    read_ahead_signal (sectors, sector_cnt);
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at
@@ -583,7 +1000,17 @@ allocate_zeroed_block (struct inode_disk *inode_data, off_t offset)
    Writes that go beyond the end of file extend the file,
    up to the maximum allowable file size. If OFFSET is
    beyond end of file to begin with, the file is first
-   zero-extended to OFFSET. */
+   zero-extended to OFFSET.
+
+   Sectors are allocated in contiguous runs for blocks of
+   the write that are not yet mapped, and a write that
+   appends to a regular file preallocates further blocks in
+   proportion to the file's size. Bytes past the end of
+   file are never read, so a block that lies entirely past
+   the end of file, or that fills a hole, is zeroed in the
+   cache rather than read from disk before it is written.
+   Thus the bytes past the end of file in every block are
+   always zero. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset)
@@ -600,204 +1027,111 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
     }
   lock_conditional_release (&inode->lock, release);
 
-  /* Get inode_disk from cache and set cache_entry to dirty. */
-  size_t inode_block_idx = cache_get_block (inode->sector, INODE);
-  struct cache_entry *inode_ce = cache_idx_to_cache_entry (inode_block_idx);
-  void *inode_block_addr = cache_idx_to_cache_block_addr (inode_block_idx);
-  struct inode_disk *inode_data = (struct inode_disk *) inode_block_addr;
-  inode_ce->dirty = true;
+  rw_lock_shared_acquire (&inode->rw_lock);
+  struct inode_disk *inode_data = &inode->data;
 
-  /* Acquire exclusive if you need to extend. */
+  /* Acquire exclusive if you need to extend or to allocate
+     blocks. */
   bool extend = false;
-  if (offset + size > inode_data->length)
+  if (offset + size > inode_data->length
+      || !inode_range_mapped (inode_data, offset, offset + size))
     {
       extend = true;
-      cache_shared_to_exclusive (inode_block_addr);
-
-      /* Recheck condition that you still need to extend.
-         If you don't, convert lock access to shared. */
-      if (offset + size <= inode_data->length)
-        {
-          extend = false;
-          cache_exclusive_to_shared (inode_block_addr);
-        }
+      rw_lock_shared_to_exclusive (&inode->rw_lock);
     }
   
-  /* If OFFSET > current file length, fill gap with zeroed blocks. */
-  off_t initial_length = inode_data->length;
-  off_t gap_size = offset - initial_length;
-  if (offset > inode_data->length)
+  /* First file block that lies entirely past the end of file. */
+  off_t length = inode_data->length;
+  size_t new_block = bytes_to_sectors (length);
+
+  /* File blocks mapped by this write's latest allocation,
+     which may fill a hole within the file. */
+  size_t fresh_start = 0;
+  size_t fresh_end = 0;
+
+  /* If OFFSET > current file length, zero the preallocated
+     blocks in the gap, which become part of the file. The
+     unmapped blocks of the gap stay holes. */
+  for (size_t block = new_block; block < (size_t) offset / BLOCK_SECTOR_SIZE;
+       block++)
     {
-      bool success = zero_fill_gap (inode_data, gap_size);
-      if (!success)
-        return bytes_written;
+      block_sector_t sector_idx =
+        byte_to_sector (inode_data, block * BLOCK_SECTOR_SIZE);
+      if (sector_idx != SECTOR_NOT_PRESENT)
+        cache_exclusive_release (cache_get_block_zeroed (sector_idx, DATA));
     }
-    
 
   /* Write data bytes starting at OFFSET. */
   while (size > 0)
     {
-      /* Sector of block corresponding to file position OFFSET. */
+      size_t block = offset / BLOCK_SECTOR_SIZE;
       block_sector_t sector_idx = byte_to_sector (inode_data, offset);
-      
-      off_t chunk = 0;
 
-      /* If sector not present, write/extend file. */
+      /* If sector not present, allocate sectors for the rest
+         of the write, preallocating more if appending to a
+         regular file. Directories are not preallocated for,
+         since the root and working directories may stay open
+         until shutdown, so that they would never be trimmed. */
       if (sector_idx == SECTOR_NOT_PRESENT)
         {
-          chunk = extend_write (inode_data, offset, buffer, 
-                                      size, bytes_written);
-          if (chunk == 0)
-            return bytes_written;
+          size_t cnt = DIV_ROUND_UP (offset + size, BLOCK_SECTOR_SIZE) - block;
+          size_t prealloc = 0;
+          if (block >= new_block && inode->type != DIR)
+            prealloc = new_block < INODE_PREALLOC_MAX
+                       ? new_block : INODE_PREALLOC_MAX;
+
+          size_t mapped = inode_allocate (inode, block, cnt, prealloc);
+          if (mapped == 0)
+            break;
+          fresh_start = block;
+          fresh_end = block + mapped;
+          sector_idx = byte_to_sector (inode_data, offset);
+        }
 
+      /* Calculate number of bytes to write. */
+      off_t sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      int chunk = size < sector_left ? size : sector_left;
+
+      /* Write full or partial block of data to the sector. Set
+         dirty only after the write, since writers within the
+         file hold the block shared and a concurrent flush may
+         be writing it back. Newly allocated blocks hold stale
+         data on disk, so they are zeroed rather than read. */
+      if (block >= new_block || (block >= fresh_start && block < fresh_end))
+        {
+          void *cache_block_addr = cache_get_block_zeroed (sector_idx, DATA);
+          memcpy (cache_block_addr + sector_ofs, buffer + bytes_written,
+                  chunk);
+          cache_exclusive_release (cache_block_addr);
         }
-      /* Otherwise, just perform normal write within file. */
       else
-         chunk = normal_write (inode_data, sector_idx, offset, 
-                               buffer, size, bytes_written, extend);
+        {
+          void *cache_block_addr = cache_get_block_shared (sector_idx, DATA);
+          memcpy (cache_block_addr + sector_ofs, buffer + bytes_written,
+                  chunk);
+          cache_mark_dirty (cache_block_addr);
+          cache_shared_release (cache_block_addr);
+        }
 
       /* Advance. */
       size -= chunk;
       offset += chunk;
       bytes_written += chunk;
     }
-  
-  cache_conditional_release (inode_block_addr, extend);
-  return bytes_written;
-}
-
-/* Called in inode_write_at to fill space between the file's initial 
-   length and the start pos of a write with zeros. Fills GAP_SIZE bytes 
-   with zeros starting at the file's initial length. */
-static bool
-zero_fill_gap (struct inode_disk *inode_data, off_t gap_size)
-{
-  off_t cur_pos = 0;
-  while (cur_pos < gap_size)
-    {
-      /* Sector to zero-fill. */
-      block_sector_t sector_idx = byte_to_sector (inode_data, cur_pos);
-      int sector_ofs = cur_pos % BLOCK_SECTOR_SIZE;
-
-      if (sector_idx == SECTOR_NOT_PRESENT)
-        {
-          /* Allocate a new disk sector. */
-          block_sector_t new_sector = 0;
-          if (!free_map_allocate (1, &new_sector))
-            {
-              cache_exclusive_release ((void *) inode_data);
-              return false;
-            }
-
-          /* Get new disk sector into the cache. */
-          void *d_cache_block_addr = 
-            cache_get_block_exclusive (new_sector, DATA);
-          
-          /* Calculate number of zero bytes to write. */
-          int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-          int gap_left = gap_size - cur_pos;
-          int chunk = gap_left < sector_left ? gap_left : sector_left;
-
-          /* Write full or partial block of zeros to the new sector. */
-          memset (d_cache_block_addr + sector_ofs, 0, chunk);
-          cache_exclusive_release (d_cache_block_addr);
-
-          /* Write new sector number to inode_disk. */
-          if (!add_new_block (inode_data, new_sector, cur_pos))
-            {
-              free_map_release (new_sector, 1);
-              cache_exclusive_release ((void *) inode_data);
-              return false;
-            }
-
-          /* Advance. */
-          inode_data->length += chunk;
-          cur_pos += chunk;
-        }
-    }
-  
-  return true;
-}
-
-/* Called in inode_write_at to perform an extending-write.
-   Allocates a new block, writes data to the block, and puts
-   new block's sector number in inode. */
-static off_t
-extend_write (struct inode_disk *inode_data, off_t offset, 
-              const uint8_t *buffer, off_t size, off_t bytes_written)
-{
-  /* Allocate a new disk sector. */
-  block_sector_t new_sector = 0;
-  if (!free_map_allocate (1, &new_sector))
-    {
-      cache_exclusive_release ((void *) inode_data);
-      return 0;
-    }
-
-  /* Get new disk sector into the cache. */
-  void *d_cache_block_addr = 
-    cache_get_block_exclusive (new_sector, DATA);
-
-  /* Calculate number of bytes to write. */
-  off_t sector_ofs = offset % BLOCK_SECTOR_SIZE;
-  int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-  int chunk = size < sector_left ? size : sector_left;
-
-  /* Write full or partial block of data to the new sector. */
-  memset (d_cache_block_addr, 0, BLOCK_SECTOR_SIZE);
-  memcpy (d_cache_block_addr + sector_ofs, 
-          buffer + bytes_written, chunk);
-  cache_exclusive_release (d_cache_block_addr);
-
-  /* Write new sector number to inode_disk. */
-  if (!add_new_block (inode_data, new_sector, offset))
-    {
-      free_map_release (new_sector, 1);
-      cache_exclusive_release ((void *) inode_data);
-      return 0;
-    }
-
-  /* Update length of file in inode_disk. */
-  if (offset >= inode_data->length)
-    inode_data->length += chunk;
-
-  return chunk;
-}
-
-/* Called in inode_write_at to perform a non-extending write. 
-   Writes data from the buffer into the block at sector SECTOR. */
-static off_t
-normal_write (struct inode_disk *inode_data, block_sector_t sector,
-              off_t offset, const uint8_t *buffer, off_t size, 
-              off_t bytes_written, bool extend)
-{
-  /* Get data block from cache. */
-  size_t cache_idx = cache_get_block (sector, DATA);
-  struct cache_entry *ce = cache_idx_to_cache_entry (cache_idx);
-  void *cache_block_addr = cache_idx_to_cache_block_addr (cache_idx);
-  ce->dirty = true;
 
-  /* Calculate number of bytes to write. */
-  off_t sector_ofs = offset % BLOCK_SECTOR_SIZE;
-  int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-  int chunk = size < sector_left ? size : sector_left;
-
-  /* Write full or partial block of data to the sector. */
-  memcpy (cache_block_addr + sector_ofs, buffer + bytes_written, chunk);
-  rw_lock_shared_release (&ce->rw_lock);
-
-  /* Get inode_disk block of file from cache and update length
-      if write was beyond end of file in last sector. */
-  if (offset >= inode_data->length)
+  /* Update length of file in inode_disk, and write the
+     changes through to the cache. */
+  if (extend)
     {
-      if (!extend)
-        cache_shared_to_exclusive ((void *) inode_data);
-      inode_data->length += chunk;
-      if (!extend)
-        cache_exclusive_to_shared ((void *) inode_data);
+      if (offset > inode_data->length)
+        inode_data->length = offset;
+      inode_write_disk (inode);
+      rw_lock_exclusive_release (&inode->rw_lock);
     }
-  
-  return chunk;
+  else
+    rw_lock_shared_release (&inode->rw_lock);
+  return bytes_written;
 }
 
 /* Disables writes to INODE.
@@ -824,14 +1158,10 @@ inode_allow_write (struct inode *inode)
   lock_release (&inode->lock);
 }
 
-/* Returns the length, in bytes, of INODE's data. */
+/* Returns the length, in bytes, of INODE's data. The length
+   is read in a single access, so no lock is needed. */
 off_t
 inode_length (const struct inode *inode)
 {
-  /* Get inode_disk from cache in order to read length field. */
-  void *inode_block_addr = cache_get_block_shared (inode->sector, INODE);
-  struct inode_disk *inode_data = (struct inode_disk *) inode_block_addr;
-  off_t length = inode_data->length;
-  cache_shared_release (inode_block_addr);
-  return length;
+  return inode->data.length;
 }
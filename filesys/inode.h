@@ -1,29 +1,27 @@
 #ifndef FILESYS_INODE_H
 #define FILESYS_INODE_H
 
+#include <hash.h>
 #include <list.h>
 #include <stdbool.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
 #include "threads/synch.h"
 
-/* The total number of sectors (indir_block or data) that
-   can be pointed to by an inode_disk struct. */
-#define INODE_SECTORS 125
+/* The number of extents that fit in an inode_disk struct,
+   and in an extent tree node. */
+#define INODE_EXTENTS 41
+#define EXTENT_NODE_EXTENTS 42
 
-/* The number of data sectors that can be pointed to
-   directly by an inode_disk struct (direct block). */
-#define NUM_DIRECT 123
+/* Most blocks preallocated past the end of a file that is
+   being appended to. A file is given about as many more
+   blocks as it already has, up to this limit. */
+#define INODE_PREALLOC_MAX 64
 
-/* The number of data sectors that can be pointed to by
-   an indir_block struct (indirect block). */
-#define NUM_INDIRECT 128
-
-/* Constants needed for byte to sector calculations. */
-#define INDIR NUM_DIRECT
-#define DOUBLE_INDIR (NUM_DIRECT + 1)
-#define NUM_DIR_INDIR (NUM_DIRECT + NUM_INDIRECT)
-#define NUM_FILE_MAX (NUM_DIR_INDIR + (NUM_INDIRECT * NUM_INDIRECT))
+/* Bounds on the number of sectors read ahead of a
+   sequential reader. */
+#define READ_AHEAD_MIN 2
+#define READ_AHEAD_MAX 32
 
 /* Type of file. */
 enum inode_type
@@ -33,40 +31,71 @@ enum inode_type
     DIR
   };
 
+/* A run of contiguous file blocks stored in contiguous
+   disk sectors. In an index node of the extent tree, an
+   extent instead refers to the child node in sector START,
+   which covers the file blocks from BLOCK up to the BLOCK
+   of the next index entry, and LEN is unused. */
+struct extent
+  {
+    uint32_t block;             /* First file block. */
+    block_sector_t start;       /* Disk sector of first block. */
+    uint32_t len;               /* Number of blocks. */
+  };
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   The data of the file is described by a tree of extents,
+   sorted by file block and not overlapping, whose root is
+   stored in the inode_disk. If DEPTH is 0, the root holds
+   the extents of the file. Otherwise, it holds index
+   entries for DEPTH levels of extent_nodes below it, and the
+   extents of the file are in the nodes of the lowest level.
+   File blocks that no extent covers are not allocated. */
 struct inode_disk
   {
     off_t length;                           /* File size in bytes. */
     unsigned magic;                         /* Magic number. */
     enum inode_type type;                   /* Directory, file, or freemap? */
-    block_sector_t sectors[INODE_SECTORS];  /* Sector entries. */
+    uint32_t extent_cnt;                    /* Number of entries in use. */
+    struct extent extents[INODE_EXTENTS];   /* Root entries, by block. */
+    uint32_t depth;                         /* Levels of extent_nodes. */
+  };
+
+/* Extent tree node below the root in the inode_disk.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_node
+  {
+    uint32_t extent_cnt;                        /* Entries in use. */
+    struct extent extents[EXTENT_NODE_EXTENTS]; /* Entries, by block. */
+    uint32_t unused;                            /* Not used. */
   };
 
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open inode table. */
+    struct list_elem reclaim_elem;      /* Element in reclaim list. */
     block_sector_t sector;              /* Sector number of disk location. */
     enum inode_type type;               /* Directory, file, or freemap? */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct lock lock;                   /* Lock for sequential operations. */
-  };
-
-/* An indirect block contains sector numbers which refer
-   to blocks that contain actual data.
-   
-   Must be exactly BLOCK_SECTOR_SIZE bytes in size. */
-struct indir_block
-  {
-    block_sector_t sectors[NUM_INDIRECT];
+    off_t ra_next;                      /* Offset of next sequential read. */
+    size_t ra_window;                   /* Read-ahead window in sectors. */
+    size_t ra_end;                      /* First file block not yet read
+                                           ahead. */
+    struct rw_lock rw_lock;             /* Protects data. */
+    struct inode_disk data;             /* Copy of the inode_disk, written
+                                           through to the cache. */
   };
 
 struct bitmap;
 
 void inode_init (void);
+void inode_done (void);
 bool inode_create (block_sector_t, off_t, enum inode_type);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
@@ -1,50 +1,61 @@
 #include "filesys/path.h"
 #include <debug.h>
 #include <stdio.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "threads/malloc.h"
+#include "threads/thread.h"
 
 /* Primarily called to open last parent subdirectory in a full 
    path. Converts string PATH to an open inode, which the caller 
-   is responsible for closing. */
+   is responsible for closing. Each component is resolved to
+   a sector through the dentry cache. */
 struct inode * 
 path_to_inode (const char *path)
 {    
+  /* If entire path is "/", return root inode. */
+  if (path[0] == '/' && path[1] == '\0')
+    return inode_open (ROOT_DIR_SECTOR);
+
   /* Make copy of path. */
-  char *path_copy = malloc (strlen (path) + 1);
+  size_t path_size = strlen (path) + 1;
+  char *path_copy = malloc (path_size);
   if (path_copy == NULL)
     PANIC ("path_to_inode: memory allocation failed for path_copy");
     
-  strlcpy (path_copy, path, strlen (path) + 1);
-
-  /* If entire path is "/", return root inode. */
-  if (path_copy[0] == '/' && strlen (path_copy) == 1)
-    return inode_open (ROOT_DIR_SECTOR);
+  strlcpy (path_copy, path, path_size);
 
+  /* Traverse path, starting at the root directory if PATH is
+     absolute and at the current working directory otherwise.
+     The directory being searched is kept open until the next
+     component is open, so that its sector cannot be freed and
+     reused meanwhile. */
+  struct inode *inode;
+  if (path[0] == '/')
+    inode = inode_open (ROOT_DIR_SECTOR);
+  else
+    inode = inode_reopen (thread_current ()->cwd_inode);
   char *token, *ptr;
-  struct dir *dir = get_start_dir (path_copy);
-
-  /* Traverse path. */
-  struct inode *inode = NULL;
   for (token = strtok_r (path_copy, "/", &ptr); token != NULL; 
        token = strtok_r (NULL, "/", &ptr))
     {
-      const struct dir *const_dir = (const struct dir *) dir;
-      const char *const_name = (const char *) token;
-      
-      /* Synchronization in inode_read_at makes dir_lookup safe in
-         context of potentially searching for dir_entry being removed. */
-      if (dir_lookup (const_dir, const_name, &inode))
+      /* Only descend into directories that are still in use. */
+      if (inode == NULL || inode->type != DIR || inode->removed)
         {
-          if (dir->inode->sector != ROOT_DIR_SECTOR)
-            inode_close (dir->inode);
-          dir->inode = inode;
-          dir->pos = 0;
+          inode_close (inode);
+          inode = NULL;
+          break;
         }
-      else
-        return NULL;
+
+      block_sector_t sector = dir_lookup_sector (inode, token);
+      struct inode *next = NULL;
+      if (sector != SECTOR_NOT_PRESENT)
+        next = inode_open (sector);
+      inode_close (inode);
+      inode = next;
     }
-  
+  free (path_copy);
+
   return inode;
 }
 
@@ -79,11 +90,10 @@ extract_base (const char *path)
      Else, just return "/" as base. */
   if (base_len != 0)
     {
-      base = malloc (sizeof (last_slash - path + 1));
+      base = malloc (base_len + 1);
       if (base == NULL)
         PANIC ("extract_base: malloc failed for base.");
       strlcpy (base, path, base_len + 1);
-      base[base_len + 1] = '\0';
     }
   else
     base = "/";
@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($fs);
+for (my ($i) = 0; $i < 1000; $i += 2) {
+    $fs->{'x'}{"f$i"} = [''];
+}
+check_archive ($fs);
+pass;
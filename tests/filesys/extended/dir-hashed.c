@@ -0,0 +1,103 @@
+/* Creates 1,000 files in a directory, more than its hash
+   buckets can hold without overflow buckets, then opens each
+   one, reads the directory back, removes every other file,
+   and checks that exactly the rest are left. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 1000
+
+/* Reads directory "/x" and checks that it holds exactly the
+   files "f<i>" for the I less than FILE_CNT that are
+   multiples of STEP, each once, and nothing else, in
+   particular not ".", "..", or any internal entry. */
+static void
+check_dir (int step) 
+{
+  static bool seen[FILE_CNT];
+  char name[READDIR_MAX_LEN + 1];
+  int cnt = 0;
+  int fd;
+
+  memset (seen, 0, sizeof seen);
+  CHECK ((fd = open ("/x")) > 1, "open \"/x\"");
+  while (readdir (fd, name)) 
+    {
+      char expected[READDIR_MAX_LEN + 1];
+      int i = name[0] == 'f' ? atoi (name + 1) : -1;
+
+      snprintf (expected, sizeof expected, "f%d", i);
+      if (i < 0 || i >= FILE_CNT || strcmp (name, expected)
+          || i % step != 0)
+        fail ("readdir \"/x\" returned unexpected name \"%s\"", name);
+      if (seen[i])
+        fail ("readdir \"/x\" returned \"%s\" twice", name);
+      seen[i] = true;
+      cnt++;
+    }
+  CHECK (cnt == (FILE_CNT + step - 1) / step,
+         "readdir \"/x\" returned %d names", (FILE_CNT + step - 1) / step);
+  msg ("close \"/x\"");
+  close (fd);
+}
+
+void
+test_main (void) 
+{
+  char file_name[32];
+  int fd;
+  int i;
+
+  CHECK (mkdir ("/x"), "mkdir \"/x\"");
+
+  msg ("creating /x/f0 through /x/f%d", FILE_CNT - 1);
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (file_name, sizeof file_name, "/x/f%d", i);
+      CHECK (create (file_name, 0), "create \"%s\"", file_name);
+    }
+  quiet = false;
+  CHECK (!create ("/x/f500", 0), "create \"/x/f500\" again (must fail)");
+
+  msg ("opening /x/f0 through /x/f%d", FILE_CNT - 1);
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (file_name, sizeof file_name, "/x/f%d", i);
+      CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+      close (fd);
+    }
+  quiet = false;
+  check_dir (1);
+
+  msg ("removing /x/f1, /x/f3, ..., /x/f%d", FILE_CNT - 1);
+  quiet = true;
+  for (i = 1; i < FILE_CNT; i += 2) 
+    {
+      snprintf (file_name, sizeof file_name, "/x/f%d", i);
+      CHECK (remove (file_name), "remove \"%s\"", file_name);
+    }
+  quiet = false;
+
+  msg ("opening /x/f0 through /x/f%d", FILE_CNT - 1);
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (file_name, sizeof file_name, "/x/f%d", i);
+      fd = open (file_name);
+      if (i % 2 == 0)
+        CHECK (fd > 1, "open \"%s\"", file_name);
+      else
+        CHECK (fd == -1, "open \"%s\" (must return -1)", file_name);
+      if (fd > 1)
+        close (fd);
+    }
+  quiet = false;
+  check_dir (2);
+}
@@ -0,0 +1,21 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-hashed) begin
+(dir-hashed) mkdir "/x"
+(dir-hashed) creating /x/f0 through /x/f999
+(dir-hashed) create "/x/f500" again (must fail)
+(dir-hashed) opening /x/f0 through /x/f999
+(dir-hashed) open "/x"
+(dir-hashed) readdir "/x" returned 1000 names
+(dir-hashed) close "/x"
+(dir-hashed) removing /x/f1, /x/f3, ..., /x/f999
+(dir-hashed) opening /x/f0 through /x/f999
+(dir-hashed) open "/x"
+(dir-hashed) readdir "/x" returned 500 names
+(dir-hashed) close "/x"
+(dir-hashed) end
+EOF
+pass;
@@ -0,0 +1,11 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($data) = "\0" x 123456;
+substr ($data, 1000, 100) = 'a' x 100;
+substr ($data, 30000, 5000) = 'b' x 5000;
+substr ($data, 70000, 512) = 'c' x 512;
+substr ($data, 122456, 1000) = 'd' x 1000;
+check_archive ({"testfile" => [$data]});
+pass;
@@ -0,0 +1,41 @@
+/* Writes data at offsets far apart in a file, leaving holes of
+   many sectors between them, then fills part of one hole, and
+   checks that the rest of the holes read back as zeros. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[123456];
+
+/* Writes SIZE bytes of BUF at offset OFS in the file open as FD. */
+static void
+write_at (int fd, const char *file_name, size_t ofs, size_t size)
+{
+  seek (fd, ofs);
+  CHECK (write (fd, buf + ofs, size) == (int) size,
+         "write %zu bytes at offset %zu in \"%s\"", size, ofs, file_name);
+}
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  int fd;
+
+  memset (buf + 1000, 'a', 100);
+  memset (buf + 30000, 'b', 5000);
+  memset (buf + 70000, 'c', 512);
+  memset (buf + sizeof buf - 1000, 'd', 1000);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  write_at (fd, file_name, 1000, 100);
+  write_at (fd, file_name, 30000, 5000);
+  write_at (fd, file_name, sizeof buf - 1000, 1000);
+  write_at (fd, file_name, 70000, 512);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-holes) begin
+(grow-holes) create "testfile"
+(grow-holes) open "testfile"
+(grow-holes) write 100 bytes at offset 1000 in "testfile"
+(grow-holes) write 5000 bytes at offset 30000 in "testfile"
+(grow-holes) write 1000 bytes at offset 122456 in "testfile"
+(grow-holes) write 512 bytes at offset 70000 in "testfile"
+(grow-holes) close "testfile"
+(grow-holes) open "testfile" for verification
+(grow-holes) verified contents of "testfile"
+(grow-holes) close "testfile"
+(grow-holes) end
+EOF
+pass;
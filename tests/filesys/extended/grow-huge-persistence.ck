@@ -0,0 +1,7 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($data) = join ('', map (pack ("V", $_) . ("\x5a" x 508), 0...18431));
+check_archive ({"huge" => [$data]});
+pass;
@@ -0,0 +1,67 @@
+/* Grows a file to 9 MB, more than the 8 MB that a file could
+   span before the extent map grew into a tree, and checks
+   that every sector of it reads back in place. */
+
+#include <stdint.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE (9 * 1024 * 1024)
+#define SECTOR_SIZE 512
+
+static char buf[65536];
+static char data[65536];
+
+/* Fills BUF with the part of the file at offset OFS. Each
+   sector begins with its sector number, and the rest of it is
+   a fixed byte. */
+static void
+fill_buf (size_t ofs) 
+{
+  size_t i;
+
+  for (i = 0; i < sizeof buf; i += SECTOR_SIZE)
+    {
+      uint32_t sector = (ofs + i) / SECTOR_SIZE;
+      memset (buf + i, 0x5a, SECTOR_SIZE);
+      memcpy (buf + i, &sector, sizeof sector);
+    }
+}
+
+void
+test_main (void) 
+{
+  const char *file_name = "huge";
+  size_t ofs;
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("writing \"%s\"", file_name);
+  for (ofs = 0; ofs < FILE_SIZE; ofs += sizeof buf)
+    {
+      fill_buf (ofs);
+      if (write (fd, buf, sizeof buf) != (int) sizeof buf)
+        fail ("write %zu bytes at offset %zu in \"%s\" failed",
+              sizeof buf, ofs, file_name);
+    }
+  CHECK (filesize (fd) == FILE_SIZE, "filesize \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\" for verification",
+         file_name);
+  for (ofs = 0; ofs < FILE_SIZE; ofs += sizeof data)
+    {
+      fill_buf (ofs);
+      if (read (fd, data, sizeof data) != (int) sizeof data)
+        fail ("read %zu bytes at offset %zu in \"%s\" failed",
+              sizeof data, ofs, file_name);
+      compare_bytes (data, buf, sizeof data, ofs, file_name);
+    }
+  msg ("verified contents of \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-huge) begin
+(grow-huge) create "huge"
+(grow-huge) open "huge"
+(grow-huge) writing "huge"
+(grow-huge) filesize "huge"
+(grow-huge) close "huge"
+(grow-huge) open "huge" for verification
+(grow-huge) verified contents of "huge"
+(grow-huge) close "huge"
+(grow-huge) end
+EOF
+pass;
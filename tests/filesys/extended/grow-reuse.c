@@ -0,0 +1,72 @@
+/* Creates a file that takes up more than half of the free
+   space on the disk, checks it, and removes it, several times
+   over. Each new file fits only once the blocks of the file
+   removed before it have been freed, and none of its sectors
+   may read back data of an earlier file. */
+
+#include <stdint.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE (1024 * 1024)
+#define SECTOR_SIZE 512
+#define ROUND_CNT 4
+
+static char buf[4096];
+static char data[4096];
+
+/* Fills BUF with the part of the file of round ROUND at offset
+   OFS. Each sector begins with the round and its sector number,
+   and the rest of it is a byte that depends on the round. */
+static void
+fill_buf (int round, size_t ofs) 
+{
+  size_t i;
+
+  for (i = 0; i < sizeof buf; i += SECTOR_SIZE)
+    {
+      uint32_t stamp[2] = {round, (ofs + i) / SECTOR_SIZE};
+      memset (buf + i, 'a' + round, SECTOR_SIZE);
+      memcpy (buf + i, stamp, sizeof stamp);
+    }
+}
+
+void
+test_main (void) 
+{
+  const char *file_name = "reuse";
+  int round;
+
+  for (round = 0; round < ROUND_CNT; round++)
+    {
+      size_t ofs;
+      int fd;
+
+      CHECK (create (file_name, 0), "create \"%s\"", file_name);
+      CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+      msg ("writing \"%s\"", file_name);
+      for (ofs = 0; ofs < FILE_SIZE; ofs += sizeof buf)
+        {
+          fill_buf (round, ofs);
+          if (write (fd, buf, sizeof buf) != (int) sizeof buf)
+            fail ("write %zu bytes at offset %zu in \"%s\" failed",
+                  sizeof buf, ofs, file_name);
+        }
+
+      msg ("verifying \"%s\"", file_name);
+      seek (fd, 0);
+      for (ofs = 0; ofs < FILE_SIZE; ofs += sizeof data)
+        {
+          fill_buf (round, ofs);
+          if (read (fd, data, sizeof data) != (int) sizeof data)
+            fail ("read %zu bytes at offset %zu in \"%s\" failed",
+                  sizeof data, ofs, file_name);
+          compare_bytes (data, buf, sizeof data, ofs, file_name);
+        }
+      msg ("close \"%s\"", file_name);
+      close (fd);
+      CHECK (remove (file_name), "remove \"%s\"", file_name);
+    }
+}
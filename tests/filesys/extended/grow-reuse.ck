@@ -0,0 +1,33 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-reuse) begin
+(grow-reuse) create "reuse"
+(grow-reuse) open "reuse"
+(grow-reuse) writing "reuse"
+(grow-reuse) verifying "reuse"
+(grow-reuse) close "reuse"
+(grow-reuse) remove "reuse"
+(grow-reuse) create "reuse"
+(grow-reuse) open "reuse"
+(grow-reuse) writing "reuse"
+(grow-reuse) verifying "reuse"
+(grow-reuse) close "reuse"
+(grow-reuse) remove "reuse"
+(grow-reuse) create "reuse"
+(grow-reuse) open "reuse"
+(grow-reuse) writing "reuse"
+(grow-reuse) verifying "reuse"
+(grow-reuse) close "reuse"
+(grow-reuse) remove "reuse"
+(grow-reuse) create "reuse"
+(grow-reuse) open "reuse"
+(grow-reuse) writing "reuse"
+(grow-reuse) verifying "reuse"
+(grow-reuse) close "reuse"
+(grow-reuse) remove "reuse"
+(grow-reuse) end
+EOF
+pass;
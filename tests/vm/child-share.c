@@ -0,0 +1,72 @@
+/* Child process of page-share.
+   Checks a 128 kB table of constants in its read-only segment,
+   then encrypts 1 MB of zeros and decrypts it again to push
+   pages out of memory, checking the table after each pass,
+   and ensures that the zeros are back. */
+
+#include <stdint.h>
+#include <string.h>
+#include "tests/arc4.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+const char *test_name = "child-share";
+
+#define SIZE (1024 * 1024)
+static char buf[SIZE];
+
+/* Table of 32,768 constants, each computed from its index. */
+#define VALUE(I) ((uint32_t) (I) * 2654435761u)
+#define ROW4(I) VALUE (I), VALUE ((I) + 1), VALUE ((I) + 2), \
+                VALUE ((I) + 3)
+#define ROW16(I) ROW4 (I), ROW4 ((I) + 4), ROW4 ((I) + 8), ROW4 ((I) + 12)
+#define ROW64(I) ROW16 (I), ROW16 ((I) + 16), ROW16 ((I) + 32), \
+                 ROW16 ((I) + 48)
+#define ROW256(I) ROW64 (I), ROW64 ((I) + 64), ROW64 ((I) + 128), \
+                  ROW64 ((I) + 192)
+#define ROW1K(I) ROW256 (I), ROW256 ((I) + 256), ROW256 ((I) + 512), \
+                 ROW256 ((I) + 768)
+#define ROW4K(I) ROW1K (I), ROW1K ((I) + 1024), ROW1K ((I) + 2048), \
+                 ROW1K ((I) + 3072)
+#define ROW16K(I) ROW4K (I), ROW4K ((I) + 4096), ROW4K ((I) + 8192), \
+                  ROW4K ((I) + 12288)
+static const uint32_t table[] = { ROW16K (0), ROW16K (16384) };
+
+/* Checks that every entry of the table holds its value. */
+static void
+check_table (void) 
+{
+  size_t i;
+
+  for (i = 0; i < sizeof table / sizeof *table; i++)
+    if (table[i] != VALUE (i))
+      fail ("table entry %zu is %08x, not %08x",
+            i, (unsigned) table[i], (unsigned) VALUE (i));
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *key = argv[argc - 1];
+  struct arc4 arc4;
+  size_t i;
+
+  check_table ();
+
+  /* Encrypt zeros. */
+  arc4_init (&arc4, key, strlen (key));
+  arc4_crypt (&arc4, buf, SIZE);
+  check_table ();
+
+  /* Decrypt back to zeros. */
+  arc4_init (&arc4, key, strlen (key));
+  arc4_crypt (&arc4, buf, SIZE);
+  check_table ();
+
+  /* Check that it's all zeros. */
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != '\0')
+      fail ("byte %zu != 0", i);
+
+  return 0x42;
+}
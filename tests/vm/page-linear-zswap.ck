@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(page-linear-zswap) begin
+(page-linear-zswap) initialize
+(page-linear-zswap) read pass
+(page-linear-zswap) read/modify/write pass one
+(page-linear-zswap) read/modify/write pass two
+(page-linear-zswap) read pass
+(page-linear-zswap) end
+EOF
+pass;
@@ -0,0 +1,24 @@
+/* Runs 4 child-share processes at once. Their read-only
+   pages all come from the same executable, so they share
+   frames, and these frames are evicted and read back while
+   the children page out their own data. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define CHILD_CNT 4
+
+void
+test_main (void)
+{
+  pid_t children[CHILD_CNT];
+  int i;
+
+  for (i = 0; i < CHILD_CNT; i++) 
+    CHECK ((children[i] = exec ("child-share")) != -1,
+           "exec \"child-share\"");
+
+  for (i = 0; i < CHILD_CNT; i++) 
+    CHECK (wait (children[i]) == 0x42, "wait for child %d", i);
+}
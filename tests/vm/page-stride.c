@@ -0,0 +1,68 @@
+/* Stamps each page of 2 MB of memory with its page number,
+   which pushes most of it out to swap, then reads the pages
+   back in descending order and in a stride that jumps between
+   swap clusters, checking and restamping each page. A swap-in
+   fault also reads in the slots next to the faulting one, and
+   each of these pages must end up at its own address. */
+
+#include <stdint.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (2 * 1024 * 1024)
+#define PAGE_SIZE 4096
+#define PAGE_CNT (SIZE / PAGE_SIZE)
+#define WORD_CNT (PAGE_SIZE / sizeof (uint32_t))
+
+/* Step between pages read in the strided pass. It shares no
+   factor with PAGE_CNT, so that the pass visits every page. */
+#define STRIDE 37
+
+static uint32_t buf[PAGE_CNT][WORD_CNT];
+
+/* Returns word W of page P as stamped in pass PASS. */
+static uint32_t
+stamp (size_t p, size_t w, int pass) 
+{
+  return (p << 16) ^ (w << 4) ^ pass;
+}
+
+/* Checks that page P holds the stamp of pass OLD_PASS, then
+   stamps it for pass NEW_PASS. */
+static void
+check_page (size_t p, int old_pass, int new_pass) 
+{
+  size_t w;
+
+  for (w = 0; w < WORD_CNT; w++)
+    {
+      if (buf[p][w] != stamp (p, w, old_pass))
+        fail ("word %zu of page %zu is %08x, not %08x",
+              w, p, (unsigned) buf[p][w],
+              (unsigned) stamp (p, w, old_pass));
+      buf[p][w] = stamp (p, w, new_pass);
+    }
+}
+
+void
+test_main (void)
+{
+  size_t p, w, i;
+
+  msg ("stamp pass");
+  for (p = 0; p < PAGE_CNT; p++)
+    for (w = 0; w < WORD_CNT; w++)
+      buf[p][w] = stamp (p, w, 1);
+
+  msg ("descending pass");
+  for (p = PAGE_CNT; p-- > 0; )
+    check_page (p, 1, 2);
+
+  msg ("strided pass");
+  for (i = 0, p = 0; i < PAGE_CNT; i++, p = (p + STRIDE) % PAGE_CNT)
+    check_page (p, 2, 3);
+
+  msg ("ascending pass");
+  for (p = 0; p < PAGE_CNT; p++)
+    check_page (p, 3, 4);
+}
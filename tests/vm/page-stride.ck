@@ -0,0 +1,13 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(page-stride) begin
+(page-stride) stamp pass
+(page-stride) descending pass
+(page-stride) strided pass
+(page-stride) ascending pass
+(page-stride) end
+EOF
+pass;
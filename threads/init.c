@@ -34,12 +34,14 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
 #ifdef VM
 #include "vm/frame.h"
 #include "vm/swap.h"
+#include "vm/zswap.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -66,6 +68,9 @@ static void paging_init (void);
 
 static char **read_command_line (void);
 static char **parse_options (char **argv);
+#ifdef FILESYS
+static size_t parse_count (const char *name, const char *value, size_t max);
+#endif
 static void run_actions (char **argv);
 static void usage (void);
 
@@ -136,6 +141,7 @@ main (void)
 #ifdef VM
   /* Initialize swap partition. */
   swap_table_init ();
+  frame_cleaner_init ();
 #endif
 
   printf ("Boot complete.\n");
@@ -258,9 +264,16 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        cache_configure (parse_count (name, value, init_ram_pages / 2
+                                      * (PGSIZE / BLOCK_SECTOR_SIZE)));
+      else if (!strcmp (name, "-flush"))
+        cache_configure_flush (parse_count (name, value, INT_MAX));
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
+      else if (!strcmp (name, "-zswap"))
+        zswap_configure (parse_count (name, value, init_ram_pages));
 #endif
 #endif
       else if (!strcmp (name, "-rs"))
@@ -288,6 +301,33 @@ parse_options (char **argv)
   return argv;
 }
 
+#ifdef FILESYS
+/* Returns VALUE, the value of option NAME, as a decimal count.
+   Panics if VALUE is missing, is not a count, or is greater
+   than MAX. */
+static size_t
+parse_count (const char *name, const char *value, size_t max)
+{
+  size_t cnt = 0;
+  const char *cp;
+
+  if (value == NULL || *value == '\0')
+    PANIC ("option `%s' requires a count (use -h for help)", name);
+  for (cp = value; *cp != '\0'; cp++)
+    {
+      size_t digit = *cp - '0';
+      if (*cp < '0' || *cp > '9')
+        PANIC ("option `%s': `%s' is not a count (use -h for help)",
+               name, value);
+      if (digit > max || cnt > (max - digit) / 10)
+        PANIC ("option `%s': %s is more than the maximum of %zu",
+               name, value, max);
+      cnt = cnt * 10 + digit;
+    }
+  return cnt;
+}
+#endif
+
 /* Runs the task specified in ARGV[1]. */
 static void
 run_task (char **argv)
@@ -384,8 +424,11 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=SECTORS     Cache SECTORS disk sectors (default 64).\n"
+          "  -flush=MSECS       Flush dirty cache blocks every MSECS ms.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
+          "  -zswap=PAGES       Compress up to PAGES pages of swap in RAM.\n"
 #endif
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
@@ -587,6 +587,27 @@ rw_lock_shared_to_exclusive (struct rw_lock *rw_lock)
   lock_release (&rw_lock->lock);
 }
 
+/* Converts shared hold on RW_LOCK to exclusive hold if the
+   caller is its only reader and there is no writer, without
+   sleeping. Returns true if successful. Otherwise, returns
+   false and the caller keeps its shared hold. */
+bool
+rw_lock_shared_try_to_exclusive (struct rw_lock *rw_lock)
+{
+  lock_acquire (&rw_lock->lock);
+
+  if (rw_lock->active_readers != 1 || rw_lock->writer != NULL)
+    {
+      lock_release (&rw_lock->lock);
+      return false;
+    }
+
+  rw_lock->active_readers--;
+  rw_lock->writer = thread_current ();
+  lock_release (&rw_lock->lock);
+  return true;
+}
+
 /* Acquires RW_LOCK as a writer, sleeping until it becomes available
    if necessary. If the writer sleeps, the waiting_writers counter
    is incremented. After acquiring the rw_lock's internal lock, the
@@ -80,6 +80,7 @@ void rw_lock_shared_acquire (struct rw_lock *);
 bool rw_lock_shared_try_acquire (struct rw_lock *);
 void rw_lock_shared_release (struct rw_lock *);
 void rw_lock_shared_to_exclusive (struct rw_lock *);
+bool rw_lock_shared_try_to_exclusive (struct rw_lock *);
 void rw_lock_exclusive_acquire (struct rw_lock *);
 void rw_lock_exclusive_release (struct rw_lock *);
 void rw_lock_exclusive_to_shared (struct rw_lock *);
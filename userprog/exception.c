@@ -196,6 +196,9 @@ page_fault (struct intr_frame *f)
         {
           bool writable = spte->writable;
           uintptr_t *pd = thread_current ()->pagedir;
+          frame_wait_eviction (spte);
+          bool swapped = spte->loc == SWAP && !spte->loaded;
+          size_t swap_idx = spte->swap_idx;
           void *kpage = frame_alloc_page (PAL_USER, spte);
           if (kpage == NULL)
             exit_error (-1);
@@ -207,6 +210,11 @@ page_fault (struct intr_frame *f)
                 exit_error (-1);
             }
 
+          /* Read the following pages along if they were swapped
+             out together with this one. */
+          if (swapped)
+            frame_read_around (upage, swap_idx);
+
           return;
         }
     }
@@ -629,7 +629,7 @@ setup_stack (void **esp)
           *((uintptr_t *) *esp) = 0;
         }
       else
-        frame_free_page (kpage);
+        frame_free_page (kpage, spte);
     }
 
   return success;
@@ -588,7 +588,7 @@ syscall_munmap (mapid_t mapid)
 static bool
 syscall_mkdir (const char *dir_path)
 {
-  return filesys_create (dir_path, 16 * sizeof (struct dir_entry), DIR);
+  return filesys_create (dir_path, 0, DIR);
 }
 
 /* Changes thread's current working directory to that of
@@ -641,7 +641,7 @@ syscall_readdir (int fd, char *name)
   dir->inode = open_file->inode;
   
   bool success = dir_readdir (dir, name);
-  open_file->pos += sizeof (struct dir_entry);
+  open_file->pos = dir->pos;
 
   free (dir);
   dir = NULL;
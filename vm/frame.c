@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "vm/swap.h"
+#include "filesys/inode.h"
 #include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
@@ -22,9 +23,39 @@ static struct lock get_frame_lock;
 static size_t clock_timeout;
 static size_t frame_cnt;
 
-static struct frame_entry *frame_evict_page (void);
+/* Number of frames whose pages are free in the user pool.
+   Protected by get_frame_lock. */
+static size_t free_frame_cnt;
+
+/* Signaled, with get_frame_lock held, when free_frame_cnt
+   drops below FRAME_RESERVE_LOW, to wake the page cleaner. */
+static struct condition cleaner_cond;
+
+/* Page cache of frames holding read-only pages of files, which
+   are shared by every process that maps the same page, hashed
+   by inode sector, file offset and number of bytes read from
+   the file. Protected by get_frame_lock, as are the sharers
+   of each frame. */
+static struct hash page_cache;
+
+static struct frame_entry *frame_evict_page (struct spte **victim,
+                                             bool *dirty);
+static void frame_write_back (struct frame_entry *frames[],
+                              struct spte *victims[], bool dirty[],
+                              size_t cnt);
 static struct frame_entry *clock_find_frame (void);
 static void clock_advance (void);
+static void frame_put_page (void *page_kaddr);
+static bool frame_shareable (const struct spte *spte);
+static void *frame_share (struct frame_entry *f, struct spte *spte);
+static void *page_cache_join (struct spte *spte);
+static struct frame_entry *page_cache_find (const struct spte *spte);
+static void frame_drop_sharer (struct frame_entry *f, struct spte *spte);
+static bool frame_is_accessed (struct frame_entry *f);
+static void frame_clear_accessed (struct frame_entry *f);
+static hash_hash_func page_cache_hash;
+static hash_less_func page_cache_less;
+static thread_func frame_cleaner NO_RETURN;
 
 /* Translates address returned by palloc_get_page() into
    address of corresponding frame in frame_table. */
@@ -60,12 +91,19 @@ frame_table_init (void)
       f->page_kaddr = NULL;
       f->spte = NULL;
       f->thread = NULL;
+      f->shared = false;
+      list_init (&f->sharers);
       lock_init (&f->lock);
     }
 
+  if (!hash_init (&page_cache, page_cache_hash, page_cache_less, NULL))
+    PANIC ("frame_table_init: failed memory allocation for page cache.");
+
   /* Initialize lock on clock algorithm usage and clock timeout. */
   lock_init (&get_frame_lock);
+  cond_init (&cleaner_cond);
   clock_timeout = 0;
+  free_frame_cnt = frame_cnt;
 
   /* Get base address of the user pool. */
   user_pool_base = palloc_get_user_pool_base ();
@@ -75,42 +113,97 @@ frame_table_init (void)
   lead_hand = frame_table_base + (frame_cnt / 4);
 }
 
+/* Spawns the page cleaner thread. Called once the thread
+   scheduler has started and the swap table is initialized. */
+void
+frame_cleaner_init (void)
+{
+  if (thread_create ("page-cleaner", PRI_DEFAULT,
+                     frame_cleaner, NULL) == TID_ERROR)
+    PANIC ("frame_cleaner_init: failed to spawn page cleaner thread.");
+}
+
 /* Obtain a page from the user pool and store it in the next
    available frame. Depending on the fields in the supplemental
    page table entry for the page, fill the page with the
-   appropriate data. Return NULL if unsuccessful. */
+   appropriate data. Return NULL if unsuccessful.
+
+   get_frame_lock is only held while a frame is chosen. If a
+   page has to be evicted, it is written out after the lock is
+   released, so that other processes can obtain frames in the
+   meantime.
+
+   A read-only page of a file is shared with every other
+   process that has the same page loaded, through the page
+   cache, and is mapped into the current process's page
+   directory by this function. */
 void *
 frame_alloc_page (enum palloc_flags flags, struct spte *spte)
 {
   ASSERT (flags & PAL_USER);
 
   struct frame_entry *f;
+  struct spte *victim = NULL;
+  bool dirty = false;
+
+  /* If the page is still being written out by an eviction,
+     wait until it can be read back. */
+  frame_wait_eviction (spte);
+
+  /* Map a shared page if another process has it loaded. */
+  bool shareable = frame_shareable (spte);
+  if (shareable)
+    {
+      void *shared_kaddr = page_cache_join (spte);
+      if (shared_kaddr != NULL)
+        return shared_kaddr;
+    }
 
   /* Get a page of memory. Evict a page if necessary. */
   lock_acquire (&get_frame_lock);
   void *page_kaddr = palloc_get_page (flags);
   if (page_kaddr == NULL)
     {
-      f = frame_evict_page ();
+      f = frame_evict_page (&victim, &dirty);
 
       /* In the highly unlikely case that both palloc_get_page 
         and our eviction algorithm were unable to find a page,
         return NULL. */
       if (f == NULL)
-        return NULL;
+        {
+          lock_release (&get_frame_lock);
+          return NULL;
+        }
 
       ASSERT (lock_held_by_current_thread (&f->lock));
     }
   else
     {
       f = page_kaddr_to_frame_addr (page_kaddr);
-      if (!lock_held_by_current_thread (&f->lock))
-        lock_acquire (&f->lock);
-        
       f->page_kaddr = page_kaddr;
+      free_frame_cnt--;
     }
+
+  /* Let the page cleaner replenish the free frames before
+     they run out. */
+  if (free_frame_cnt < FRAME_RESERVE_LOW)
+    cond_signal (&cleaner_cond, &get_frame_lock);
   lock_release (&get_frame_lock);
 
+  /* The clock skips a frame fresh from the user pool, since it
+     has no owner, but pin_frames() may briefly hold its lock
+     after looking up the page that it held before. Wait for
+     the lock only now, as no frame lock may be waited for
+     while get_frame_lock is held. */
+  if (page_kaddr != NULL && !lock_held_by_current_thread (&f->lock))
+    lock_acquire (&f->lock);
+
+  /* Write out the evicted page. The frame stays locked until
+     the page has been loaded, so that faults on the evicted
+     page wait on this frame alone. */
+  if (victim != NULL)
+    frame_write_back (&f, &victim, &dirty, 1);
+
   f->spte = spte;
   f->thread = thread_current ();
 
@@ -132,45 +225,324 @@ frame_alloc_page (enum palloc_flags flags, struct spte *spte)
       /* If file read error, free page and return NULL. */
       if (bytes_read != (int) spte->page_bytes)
         {
-          palloc_free_page (f->page_kaddr);
+          f->spte = NULL;
+          f->thread = NULL;
+          frame_put_page (f->page_kaddr);
+          f->page_kaddr = NULL;
+          lock_release (&f->lock);
           return NULL;
         }
       memset (f->page_kaddr + bytes_read, 0, PGSIZE - bytes_read);
     }
 
   spte->loaded = true;
+  page_kaddr = shareable ? frame_share (f, spte) : f->page_kaddr;
   lock_release (&f->lock);
 
-  return f->page_kaddr;
+  return page_kaddr;
 }
 
-/* Remove a page with kernel virtual address PAGE_KADDR from
-   it's frame and free the page. NOTE that a process must obtain
-   the frame's lock to clear the frame's fields. This ensures that 
-   a process cannot set the frame's fields to NULL while another 
-   process is reading that frame's data. */
+/* Remove the page with SPT entry SPTE and kernel virtual
+   address PAGE_KADDR from it's frame and free the page, or just
+   unmap it if the frame is shared with other processes. NOTE
+   that a process must obtain the frame's lock to clear the
+   frame's fields. This ensures that a process cannot set the
+   frame's fields to NULL while another process is reading
+   that frame's data. */
 void
-frame_free_page (void *page_kaddr)
+frame_free_page (void *page_kaddr, struct spte *spte)
 {
   struct frame_entry *f = page_kaddr_to_frame_addr (page_kaddr);
   if (!lock_held_by_current_thread (&f->lock))
     lock_acquire (&f->lock);
 
-  /* If we no longer own frame, return. */
-  if (f->thread != thread_current ())
+  /* Drop SPTE from the sharers of a shared page, and free the
+     page once no process maps it. */
+  if (f->shared)
     {
+      lock_acquire (&get_frame_lock);
+      struct list_elem *e;
+      for (e = list_begin (&f->sharers); e != list_end (&f->sharers);
+           e = list_next (e))
+        if (list_entry (e, struct spte, share_elem) == spte)
+          {
+            frame_drop_sharer (f, spte);
+            break;
+          }
+      lock_release (&get_frame_lock);
       lock_release (&f->lock);
       return;
     }
 
-  pagedir_clear_page (thread_current ()->pagedir, f->spte->page_uaddr);
+  /* If the frame no longer holds the page, return. */
+  if (f->spte != spte)
+    {
+      lock_release (&f->lock);
+      return;
+    }
+
+  pagedir_clear_page (thread_current ()->pagedir, spte->page_uaddr);
   f->page_kaddr = NULL;
   f->spte = NULL;
   f->thread = NULL;
-  palloc_free_page (page_kaddr); 
+  frame_put_page (page_kaddr); 
   lock_release (&f->lock);
 }
 
+/* Returns the page with kernel virtual address PAGE_KADDR to
+   the user pool. */
+static void
+frame_put_page (void *page_kaddr)
+{
+  lock_acquire (&get_frame_lock);
+  palloc_free_page (page_kaddr);
+  free_frame_cnt++;
+  lock_release (&get_frame_lock);
+}
+
+/* Returns true if the page with SPT entry SPTE is a read-only
+   page of a file that is about to be loaded, which can be
+   shared through the page cache. */
+static bool
+frame_shareable (const struct spte *spte)
+{
+  return spte->loc == DISK && !spte->writable && !spte->loaded;
+}
+
+/* Maps the page with SPT entry SPTE, which is shareable, into
+   the page directory of the current process if another process
+   already has it loaded in the page cache. Returns the kernel
+   virtual address of the shared page, or a null pointer if it
+   is not in the page cache or cannot be mapped. */
+static void *
+page_cache_join (struct spte *spte)
+{
+  void *page_kaddr = NULL;
+
+  lock_acquire (&get_frame_lock);
+  struct frame_entry *f = page_cache_find (spte);
+  if (f != NULL && pagedir_set_page (thread_current ()->pagedir,
+                                     spte->page_uaddr, f->page_kaddr,
+                                     false))
+    {
+      list_push_back (&f->sharers, &spte->share_elem);
+      spte->loaded = true;
+      page_kaddr = f->page_kaddr;
+    }
+  lock_release (&get_frame_lock);
+
+  return page_kaddr;
+}
+
+/* Adds frame F, whose lock is held and which has just been
+   loaded with the page with SPT entry SPTE, to the page cache
+   as a shared frame, and maps the page into the page directory
+   of the current process. If another process added the same
+   page to the page cache in the meantime, F is freed and that
+   page is mapped instead. Returns the kernel virtual address of
+   the mapped page, or a null pointer if it cannot be mapped. */
+static void *
+frame_share (struct frame_entry *f, struct spte *spte)
+{
+  ASSERT (lock_held_by_current_thread (&f->lock));
+
+  lock_acquire (&get_frame_lock);
+  f->spte = NULL;
+  f->thread = NULL;
+
+  struct frame_entry *cached = page_cache_find (spte);
+  if (cached != NULL)
+    {
+      palloc_free_page (f->page_kaddr);
+      f->page_kaddr = NULL;
+      free_frame_cnt++;
+      f = cached;
+    }
+  else
+    {
+      f->shared = true;
+      f->inode_sector = inode_get_inumber (file_get_inode (spte->file));
+      f->ofs = spte->ofs;
+      f->page_bytes = spte->page_bytes;
+      hash_insert (&page_cache, &f->cache_elem);
+    }
+  list_push_back (&f->sharers, &spte->share_elem);
+
+  void *page_kaddr = f->page_kaddr;
+  if (!pagedir_set_page (thread_current ()->pagedir, spte->page_uaddr,
+                         page_kaddr, false))
+    {
+      frame_drop_sharer (f, spte);
+      page_kaddr = NULL;
+    }
+  lock_release (&get_frame_lock);
+
+  return page_kaddr;
+}
+
+/* Returns the shared frame in the page cache that holds the
+   page of the file that SPTE maps, or a null pointer if there
+   is none. get_frame_lock must be held. */
+static struct frame_entry *
+page_cache_find (const struct spte *spte)
+{
+  ASSERT (lock_held_by_current_thread (&get_frame_lock));
+
+  struct frame_entry key;
+  struct hash_elem *e;
+
+  key.inode_sector = inode_get_inumber (file_get_inode (spte->file));
+  key.ofs = spte->ofs;
+  key.page_bytes = spte->page_bytes;
+  e = hash_find (&page_cache, &key.cache_elem);
+  return e != NULL ? hash_entry (e, struct frame_entry, cache_elem) : NULL;
+}
+
+/* Unmaps the page in shared frame F from the process that
+   SPTE belongs to and removes SPTE from the sharers of F. Once
+   F has no sharers left, removes it from the page cache and
+   frees its page. get_frame_lock must be held. */
+static void
+frame_drop_sharer (struct frame_entry *f, struct spte *spte)
+{
+  ASSERT (lock_held_by_current_thread (&get_frame_lock));
+  ASSERT (f->shared);
+
+  pagedir_clear_page (spte->thread->pagedir, spte->page_uaddr);
+  list_remove (&spte->share_elem);
+  spte->loaded = false;
+
+  if (list_empty (&f->sharers))
+    {
+      hash_delete (&page_cache, &f->cache_elem);
+      f->shared = false;
+      palloc_free_page (f->page_kaddr);
+      f->page_kaddr = NULL;
+      free_frame_cnt++;
+    }
+}
+
+/* Returns true if the page in frame F has been accessed by
+   the process that owns it or, if F is shared, by any of the
+   processes that share it. */
+static bool
+frame_is_accessed (struct frame_entry *f)
+{
+  if (!f->shared)
+    return pagedir_is_accessed (f->thread->pagedir, f->spte->page_uaddr);
+
+  struct list_elem *e;
+  for (e = list_begin (&f->sharers); e != list_end (&f->sharers);
+       e = list_next (e))
+    {
+      struct spte *spte = list_entry (e, struct spte, share_elem);
+      if (pagedir_is_accessed (spte->thread->pagedir, spte->page_uaddr))
+        return true;
+    }
+  return false;
+}
+
+/* Clears the accessed bit of the page in frame F in the page
+   directory of every process that maps it. */
+static void
+frame_clear_accessed (struct frame_entry *f)
+{
+  if (f->thread != NULL)
+    pagedir_set_accessed (f->thread->pagedir, f->spte->page_uaddr, false);
+  else if (f->shared)
+    {
+      struct list_elem *e;
+      for (e = list_begin (&f->sharers); e != list_end (&f->sharers);
+           e = list_next (e))
+        {
+          struct spte *spte = list_entry (e, struct spte, share_elem);
+          pagedir_set_accessed (spte->thread->pagedir, spte->page_uaddr,
+                                false);
+        }
+    }
+}
+
+/* Returns a hash of the inode sector, file offset and length
+   of the page of shared frame E. */
+static unsigned
+page_cache_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct frame_entry *f = hash_entry (e, struct frame_entry,
+                                            cache_elem);
+  return hash_int (f->inode_sector) ^ hash_int (f->ofs)
+         ^ hash_int (f->page_bytes);
+}
+
+/* Returns true if shared frame A precedes shared frame B. */
+static bool
+page_cache_less (const struct hash_elem *a_, const struct hash_elem *b_,
+                 void *aux UNUSED)
+{
+  const struct frame_entry *a = hash_entry (a_, struct frame_entry,
+                                            cache_elem);
+  const struct frame_entry *b = hash_entry (b_, struct frame_entry,
+                                            cache_elem);
+
+  if (a->inode_sector != b->inode_sector)
+    return a->inode_sector < b->inode_sector;
+  if (a->ofs != b->ofs)
+    return a->ofs < b->ofs;
+  return a->page_bytes < b->page_bytes;
+}
+
+/* Page cleaner thread. Whenever it is woken up because fewer
+   than FRAME_RESERVE_LOW frames are free, it evicts pages
+   with the clock algorithm, writing them out if they are
+   dirty, and frees their frames until FRAME_RESERVE_HIGH
+   frames are free. Faulting processes then find a free frame
+   right away instead of having to evict a page themselves.
+
+   Pages are evicted in batches of up to SWAP_CLUSTER, so that
+   the ones that go to swap are written to consecutive slots. */
+static void
+frame_cleaner (void *aux UNUSED)
+{
+  struct frame_entry *frames[SWAP_CLUSTER];
+  struct spte *victims[SWAP_CLUSTER];
+  bool dirty[SWAP_CLUSTER];
+
+  lock_acquire (&get_frame_lock);
+  while (true)
+    {
+      cond_wait (&cleaner_cond, &get_frame_lock);
+
+      while (free_frame_cnt < FRAME_RESERVE_HIGH)
+        {
+          size_t cnt = 0;
+          while (cnt < SWAP_CLUSTER
+                 && free_frame_cnt + cnt < FRAME_RESERVE_HIGH)
+            {
+              frames[cnt] = frame_evict_page (&victims[cnt], &dirty[cnt]);
+              if (frames[cnt] == NULL)
+                break;
+              cnt++;
+            }
+          if (cnt == 0)
+            break;
+
+          /* Write the pages out without holding get_frame_lock,
+             as frame_alloc_page() does. */
+          lock_release (&get_frame_lock);
+          frame_write_back (frames, victims, dirty, cnt);
+          lock_acquire (&get_frame_lock);
+
+          for (size_t i = 0; i < cnt; i++)
+            {
+              struct frame_entry *f = frames[i];
+              palloc_free_page (f->page_kaddr);
+              f->page_kaddr = NULL;
+              free_frame_cnt++;
+              lock_release (&f->lock);
+            }
+        }
+    }
+}
+
 /* Find a frame to evict according to the second chance clock
    algorithm. The lead hand clears the access bit and the lag
    hand evicts a page if it's access bit is 0. NOTE that access
@@ -185,12 +557,13 @@ clock_find_frame (void)
       /* After a full iteration through the frame table, if no
          eviction candidate can be found, return NULL. */
       if (clock_timeout >= frame_cnt)
-        return NULL;
+        {
+          clock_timeout = 0;
+          return NULL;
+        }
 
       /* Clear access bit of page that lead hand points to. */
-      if (lead_hand->thread != NULL)
-        pagedir_set_accessed (lead_hand->thread->pagedir,
-                              lead_hand->spte->page_uaddr, false);
+      frame_clear_accessed (lead_hand);
 
       /* Get lock on page that is candidate for eviction. */
       if (lock_try_acquire (&lag_hand->lock))
@@ -199,12 +572,12 @@ clock_find_frame (void)
 
           struct frame_entry *f = NULL;
 
-          /* If page can be evicted or the frame is free, advance clock
-             hands, reset the clock timeout, and return the frame. */
-          if (lag_hand->thread == NULL)
-            f = lag_hand;
-          else if (!pagedir_is_accessed (lag_hand->thread->pagedir,    
-                                         lag_hand->spte->page_uaddr))
+          /* If page can be evicted, advance clock hands, reset
+             the clock timeout, and return the frame. A free frame
+             has no page to evict, and its page is in the user
+             pool, so it is skipped. */
+          if ((lag_hand->thread != NULL || lag_hand->shared)
+              && !frame_is_accessed (lag_hand))
             f = lag_hand;
           
           if (f != NULL)
@@ -238,60 +611,252 @@ clock_advance (void)
     lag_hand = frame_table_base;
 }
 
-/* Evict a page from it's frame and return the kernel virtual
-   address that is now free to be used by another process. */
+/* Evict a page from it's frame and return the frame, which is
+   now free to be used by another process. The page is unmapped
+   from its owner and marked as being evicted, but it is not
+   written out: *VICTIM is set to its SPT entry and *DIRTY to
+   whether it was written to, and the caller must pass them to
+   frame_write_back() once it has released get_frame_lock.
+   *VICTIM is set to a null pointer if the page was shared and
+   needs no writing out. The frame's lock is held on return. */
 static struct frame_entry *
-frame_evict_page (void)
+frame_evict_page (struct spte **victim, bool *dirty)
 {
   struct frame_entry *f = clock_find_frame ();
-  ASSERT (lock_held_by_current_thread (&f->lock));
 
   /* If clock algorithm completed a full cycle through the frame table
      and could not find a frame to evict, return NULL. */
   if (f == NULL)
     return NULL;
+  ASSERT (lock_held_by_current_thread (&f->lock));
+
+  /* A shared page is a clean read-only page of a file, so it
+     only needs to be unmapped from every process that shares
+     it, to be read from the file again when it is next
+     needed. */
+  if (f->shared)
+    {
+      *victim = NULL;
+      *dirty = false;
+      while (!list_empty (&f->sharers))
+        {
+          struct spte *spte = list_entry (list_pop_front (&f->sharers),
+                                          struct spte, share_elem);
+          pagedir_clear_page (spte->thread->pagedir, spte->page_uaddr);
+          spte->loaded = false;
+        }
+      hash_delete (&page_cache, &f->cache_elem);
+      f->shared = false;
+      return f;
+    }
   
   struct thread *t = f->thread;
   struct spte *spte = f->spte;
   void *upage = spte->page_uaddr;
 
-  /* Write current page in frame to disk or swap if necessary. */
-  if (spte->loc == SWAP ||
-      spte->loc == STACK ||
-      (spte->loc == ZERO && pagedir_is_dirty (t->pagedir, upage)) ||
-      (spte->loc == DISK && pagedir_is_dirty (t->pagedir, upage)))
-    {
-      size_t swap_idx = swap_write_page (f->page_kaddr);
-      spte->swap_idx = swap_idx;
-      spte->loc = SWAP;
-    }
-  else if (spte->loc == MMAP && pagedir_is_dirty (t->pagedir, upage))
-    file_write_at (spte->file, f->page_kaddr, spte->page_bytes, spte->ofs);
-  
-  /* Remove page mapping from owning thread to complete the eviction. */
-  pagedir_clear_page (t->pagedir, spte->page_uaddr);
+  /* Remove page mapping from owning thread before the page is
+     written out, so that the owner cannot change the page in
+     the meantime. A fault on the page waits on the frame's lock
+     until the eviction completes. */
+  *victim = spte;
+  *dirty = pagedir_is_dirty (t->pagedir, upage);
+  spte->evicting = f;
+  spte->loaded = false;
+  pagedir_clear_page (t->pagedir, upage);
   f->thread = NULL;
   f->spte = NULL;
-  spte->loaded = false;
 
   return f;
 }
 
+/* Completes the eviction of the CNT pages with SPT entries
+   VICTIMS from FRAMES by writing them to disk or swap if
+   necessary. DIRTY[I] tells whether page I was written to.
+   Null entries of VICTIMS are skipped. CNT must not exceed
+   SWAP_CLUSTER, and the lock of each frame must be held.
+
+   The pages that go to swap are written to a cluster of
+   consecutive swap slots in order of their user virtual
+   addresses, so that neighboring pages of a process can be
+   read back together by frame_read_around(). */
+static void
+frame_write_back (struct frame_entry *frames[], struct spte *victims[],
+                  bool dirty[], size_t cnt)
+{
+  ASSERT (cnt <= SWAP_CLUSTER);
+
+  const void *kpages[SWAP_CLUSTER];
+  struct spte *swapped[SWAP_CLUSTER];
+  size_t swap_idx[SWAP_CLUSTER];
+  size_t swap_cnt = 0;
+
+  for (size_t i = 0; i < cnt; i++)
+    {
+      struct frame_entry *f = frames[i];
+      struct spte *spte = victims[i];
+      if (spte == NULL)
+        continue;
+      ASSERT (lock_held_by_current_thread (&f->lock));
+      ASSERT (spte->evicting == f);
+
+      if (spte->loc == SWAP ||
+          spte->loc == STACK ||
+          (spte->loc == ZERO && dirty[i]) ||
+          (spte->loc == DISK && dirty[i]))
+        {
+          /* Insert into the cluster, sorted by address. */
+          size_t j;
+          for (j = swap_cnt; j > 0; j--)
+            {
+              if (swapped[j - 1]->page_uaddr < spte->page_uaddr)
+                break;
+              swapped[j] = swapped[j - 1];
+              kpages[j] = kpages[j - 1];
+            }
+          swapped[j] = spte;
+          kpages[j] = f->page_kaddr;
+          swap_cnt++;
+        }
+      else if (spte->loc == MMAP && dirty[i])
+        file_write_at (spte->file, f->page_kaddr, spte->page_bytes,
+                       spte->ofs);
+    }
+
+  if (swap_cnt > 0)
+    swap_write_pages (kpages, swap_cnt, swap_idx);
+  for (size_t i = 0; i < swap_cnt; i++)
+    {
+      swapped[i]->swap_idx = swap_idx[i];
+      swapped[i]->loc = SWAP;
+    }
+
+  for (size_t i = 0; i < cnt; i++)
+    if (victims[i] != NULL)
+      victims[i]->evicting = NULL;
+}
+
+/* Speculatively swaps in the pages of the current process
+   that follow the page at user virtual address UPAGE, which
+   was just read from swap slot SWAP_IDX, as long as they are
+   in the swap slots that follow SWAP_IDX, for up to
+   SWAP_READ_AROUND pages. Since frame_write_back() swaps out
+   neighboring pages to consecutive slots, this turns the
+   faults of a process that walks through its swapped out
+   memory into sequential reads. No page is evicted to make
+   room for a speculative read. */
+void
+frame_read_around (void *upage, size_t swap_idx)
+{
+  uint32_t *pd = thread_current ()->pagedir;
+
+  for (size_t i = 1; i <= SWAP_READ_AROUND; i++)
+    {
+      void *next_upage = (uint8_t *) upage + i * PGSIZE;
+      if (!is_user_vaddr (next_upage))
+        break;
+
+      struct spte *spte = spte_lookup (next_upage);
+      if (spte == NULL || spte->loc != SWAP || spte->loaded
+          || spte->evicting != NULL || spte->swap_idx != swap_idx + i
+          || free_frame_cnt < FRAME_RESERVE_LOW)
+        break;
+
+      void *kpage = frame_alloc_page (PAL_USER, spte);
+      if (kpage == NULL)
+        break;
+      if (!pagedir_set_page (pd, next_upage, kpage, spte->writable))
+        {
+          /* The page's swap slot was freed when it was read, so
+             put the page back to swap before freeing the frame,
+             unless it was evicted meanwhile. */
+          struct frame_entry *f = page_kaddr_to_frame_addr (kpage);
+          lock_acquire (&f->lock);
+          if (f->spte == spte)
+            {
+              const void *kpages[1] = { kpage };
+              swap_write_pages (kpages, 1, &spte->swap_idx);
+              spte->loaded = false;
+              frame_free_page (kpage, spte);
+            }
+          else
+            lock_release (&f->lock);
+          break;
+        }
+    }
+}
+
+/* Waits until the page with SPT entry SPTE, if it is being
+   evicted, has been written out, by acquiring the lock of the
+   frame it is being written out from. */
+void
+frame_wait_eviction (struct spte *spte)
+{
+  struct frame_entry *f = spte->evicting;
+  if (f != NULL && !lock_held_by_current_thread (&f->lock))
+    {
+      lock_acquire (&f->lock);
+      lock_release (&f->lock);
+    }
+}
+
+/* Pins the frame holding the page with SPT entry SPTE, a page
+   of the current process, by acquiring the frame's lock, and
+   returns the page's kernel virtual address. Returns a null
+   pointer if the page is not in a frame, once any eviction of
+   it has been written out, so that SPTE's location no longer
+   changes under the caller. The mapping is checked again once
+   the lock is held, as in pin_frames(). */
+void *
+frame_pin_page (struct spte *spte)
+{
+  uint32_t *pd = thread_current ()->pagedir;
+
+  for (;;)
+    {
+      frame_wait_eviction (spte);
+      void *kpage = pagedir_get_page (pd, spte->page_uaddr);
+      if (kpage == NULL)
+        {
+          /* An eviction sets SPTE->evicting before it unmaps the
+             page, so one that started since the wait shows here. */
+          if (spte->evicting == NULL)
+            return NULL;
+          continue;
+        }
+
+      struct frame_entry *f = page_kaddr_to_frame_addr (kpage);
+      if (lock_held_by_current_thread (&f->lock))
+        return kpage;
+      lock_acquire (&f->lock);
+      if (pagedir_get_page (pd, spte->page_uaddr) == kpage)
+        return kpage;
+      lock_release (&f->lock);
+    }
+}
+
 /* Given a user address START and a number of bytes LEN, this function
    acquires the locks for all frames spanning this range, effectively
-   pinning the frames. */
+   pinning the frames. A page may be evicted, and its frame freed,
+   while the lock is waited for, so the mapping is checked again
+   once the lock is held. */
 void 
 pin_frames (const void *start, int len)
 {
+  uint32_t *pd = thread_current ()->pagedir;
+
   for (int i = 0; i < len; i += PGSIZE)
     {
       uint8_t *pg = pg_round_down ((uint8_t *) start + i);
-      void *kpage = pagedir_get_page (thread_current ()->pagedir, pg);
-      if (kpage != NULL)
+      void *kpage;
+      while ((kpage = pagedir_get_page (pd, pg)) != NULL)
         {
           struct frame_entry *f = page_kaddr_to_frame_addr (kpage);
-          if (!lock_held_by_current_thread (&f->lock))
-            lock_acquire (&f->lock);
+          if (lock_held_by_current_thread (&f->lock))
+            break;
+          lock_acquire (&f->lock);
+          if (pagedir_get_page (pd, pg) == kpage)
+            break;
+          lock_release (&f->lock);
         }
     }
 }
@@ -1,10 +1,20 @@
 #ifndef VM_FRAME_H
 #define VM_FRAME_H
 
+#include <hash.h>
+#include <list.h>
+#include "devices/block.h"
+#include "filesys/off_t.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "vm/page.h"
 
+/* Free frame watermarks. The page cleaner thread is woken up
+   when fewer than FRAME_RESERVE_LOW frames are free, and then
+   evicts pages until FRAME_RESERVE_HIGH frames are free. */
+#define FRAME_RESERVE_LOW 8
+#define FRAME_RESERVE_HIGH 16
+
 /* Frame table entry. */
 struct frame_entry
   {
@@ -12,12 +22,26 @@ struct frame_entry
      struct spte *spte;      /* Reference to SPT entry for page in frame. */
      struct thread *thread;  /* Reference to process using the frame. */
      struct lock lock;       /* A lock to allow a process to pin the frame. */
+
+     /* Shared read-only file pages. SPTE and THREAD are null
+        for a shared frame, whose mappers are in SHARERS. */
+     bool shared;                 /* Is the frame in the page cache? */
+     struct list sharers;         /* SPT entries of sharing processes. */
+     block_sector_t inode_sector; /* Inode of the file of the page. */
+     off_t ofs;                   /* Offset of the page in the file. */
+     size_t page_bytes;           /* Bytes of the page read from the
+                                     file, the rest being zeroed. */
+     struct hash_elem cache_elem; /* Element in page cache. */
   };
 
 struct frame_entry *page_kaddr_to_frame_addr (void *page_kaddr);
 void frame_table_init (void);
+void frame_cleaner_init (void);
 void *frame_alloc_page (enum palloc_flags flags, struct spte *spte);
-void frame_free_page (void *page_kaddr);
+void frame_free_page (void *page_kaddr, struct spte *spte);
+void frame_wait_eviction (struct spte *spte);
+void *frame_pin_page (struct spte *spte);
+void frame_read_around (void *upage, size_t swap_idx);
 
 void pin_frames (const void *buffer, int length);
 void unpin_frames (const void *buffer, int length);
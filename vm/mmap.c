@@ -127,13 +127,18 @@ munmap_by_mmap_entry (struct mmap_entry *entry, struct thread *t)
       struct spte *spte = spte_lookup (curr_uaddr);
       ASSERT (spte != NULL);
 
-      /* Write page back to file if it has been written to. */
-      if (pagedir_is_dirty (t->pagedir, curr_uaddr))
-        file_write_at (spte->file, curr_uaddr, spte->page_bytes, spte->ofs);
-
-      /* Free underlying page if it is loaded in memory. */
-      if (spte->loaded)
-        frame_free_page (pagedir_get_page (t->pagedir, curr_uaddr));
+      /* Pin the page, if it is loaded in memory, so that it is
+         not evicted while it is written back and freed. An
+         evicted page has already been written back. */
+      void *kaddr = frame_pin_page (spte);
+      if (kaddr != NULL)
+        {
+          /* Write page back to file if it has been written to. */
+          if (pagedir_is_dirty (t->pagedir, curr_uaddr))
+            file_write_at (spte->file, curr_uaddr, spte->page_bytes,
+                           spte->ofs);
+          frame_free_page (kaddr, spte);
+        }
 
       list_remove (&entry->elem);
       spt_delete (&t->spt, &spte->elem);
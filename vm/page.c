@@ -76,6 +76,8 @@ spte_create (void *page_uaddr, enum location loc,
   spte->page_bytes = page_bytes;
   spte->writable = writable;
   spte->loaded = loaded;
+  spte->evicting = NULL;
+  spte->thread = thread_current ();
 
   return spte;
 }
@@ -115,15 +117,17 @@ spte_free (struct hash_elem *he, void *aux UNUSED)
 {
   struct thread *t = thread_current ();
   struct spte *spte = hash_entry (he, struct spte, elem);
-  void *kaddr = pagedir_get_page (t->pagedir, spte->page_uaddr);
+  void *kaddr = frame_pin_page (spte);
 
-  /* Frees the swap slot if the page is currently written out
-     to swap. Otherwise, if page is loaded into memory, frees
-     the page and the frame that contains it. */
-  if (!spte->loaded && spte->loc == SWAP)
+  /* If the page is loaded into memory, frees the page and the
+     frame that contains it. Otherwise, frees the swap slot if
+     the page is currently written out to swap. The frame stays
+     pinned until then, so that the page cannot be evicted
+     between the check and the free. */
+  if (kaddr != NULL)
+    frame_free_page (kaddr, spte);
+  else if (!spte->loaded && spte->loc == SWAP)
     swap_free_slot (spte->swap_idx);
-  else if (spte->loaded)
-    frame_free_page (kaddr);
 
   spt_delete (&t->spt, &spte->elem);
   free (spte);
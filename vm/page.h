@@ -5,6 +5,9 @@
 #include <hash.h>
 #include "filesys/file.h"
 
+struct frame_entry;
+struct thread;
+
 /* Page location/type used to determine what to do with the
    data in a page when it is first allocated, needs to be
    evicted, or needs to be freed. */
@@ -28,6 +31,11 @@ struct spte
     size_t page_bytes;      /* Sequence of page data that is non-zero. */ 
     bool writable;          /* Indicates if page is writable or read only. */
     bool loaded;            /* Indicates if page has been loaded. */
+    struct frame_entry *evicting; /* Frame page is being written out
+                                     from, or NULL. */
+    struct thread *thread;  /* Process the page belongs to. */
+    struct list_elem share_elem; /* Element in sharers of a shared
+                                    frame. */
     struct hash_elem elem;  /* Hash element. */
   };
 
@@ -4,15 +4,14 @@
 #include "threads/malloc.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
-
-/* Number of sectors that fit into a page. */
-#define SECTORS_PER_PG (PGSIZE / BLOCK_SECTOR_SIZE)
+#include "vm/zswap.h"
 
 /* Swap table. */
 struct swap
   {
     struct lock lock;         /* Mutual exclusion. */
     struct bitmap *used_map;  /* Bitmap of free swap slots. */
+    size_t next_idx;          /* Slot after the last cluster written. */
     struct block *block;      /* Reference to swap block. */
   };
 
@@ -31,29 +30,63 @@ swap_table_init (void)
   block_sector_t swap_size = block_size (swap_block) / SECTORS_PER_PG;
   lock_init (&swap->lock);
   swap->used_map = bitmap_create (swap_size);
+  swap->next_idx = 0;
   swap->block = swap_block;
+  zswap_init (swap_block);
 }
 
-/* Write a page of memory with kernel virtual address KPAGE
-   to swap. Return index of swap slot to which page was
-   written. Panic the kernel if the swap partition is full. */
-size_t
-swap_write_page (const void *kpage)
+/* Write the CNT pages of memory with kernel virtual addresses
+   KPAGES to swap, and store the index of the swap slot each
+   page was written to in SWAP_IDX. The pages are written to
+   consecutive slots following the last ones written, so that
+   the disk sees one sequential run of writes, unless no run
+   of CNT free slots is left, in which case they are split into
+   shorter runs. Panic the kernel if the swap partition is
+   full. */
+void
+swap_write_pages (const void *const kpages[], size_t cnt,
+                  size_t swap_idx[])
 {
-  lock_acquire (&swap->lock);
-  size_t swap_idx = bitmap_scan_and_flip (swap->used_map, 0, 1, false);
-  lock_release (&swap->lock);
+  while (cnt > 0)
+    {
+      /* Find the longest run of free slots, up to CNT, starting
+         the search where the last run ended. */
+      size_t len = cnt;
+      size_t first;
+      lock_acquire (&swap->lock);
+      while (true)
+        {
+          first = bitmap_scan_and_flip (swap->used_map, swap->next_idx,
+                                        len, false);
+          if (first == BITMAP_ERROR)
+            first = bitmap_scan_and_flip (swap->used_map, 0, len, false);
+          if (first != BITMAP_ERROR || len == 1)
+            break;
+          len /= 2;
+        }
+      if (first != BITMAP_ERROR)
+        swap->next_idx = first + len;
+      lock_release (&swap->lock);
+
+      if (first == BITMAP_ERROR)
+        PANIC ("swap_write_pages: out of swap slots");
 
-  if (swap_idx == BITMAP_ERROR)
-    PANIC ("swap_get_slot: out of swap slots");
-  
-  /* Write page in BLOCK_SECTOR_SIZE chunks to the swap slot. */
-  block_sector_t sector = swap_idx * SECTORS_PER_PG;
-  uint8_t *ofs = (void *) kpage;
-  for (size_t idx = 0; idx < SECTORS_PER_PG; idx++)
-    block_write (swap->block, sector + idx, ofs + idx * BLOCK_SECTOR_SIZE);
+      /* Keep each page in the compressed pool if possible.
+         Otherwise, write it to its swap slot in a single
+         transfer. */
+      for (size_t i = 0; i < len; i++)
+        {
+          block_sector_t sector = (first + i) * SECTORS_PER_PG;
+          if (!zswap_store (first + i, kpages[i]))
+            block_write_multiple (swap->block, sector, SECTORS_PER_PG,
+                                  kpages[i]);
+          swap_idx[i] = first + i;
+        }
 
-  return swap_idx;
+      kpages += len;
+      swap_idx += len;
+      cnt -= len;
+    }
 }
 
 /* Read a page of data in the swap slot indexed by SWAP_IDX
@@ -61,10 +94,11 @@ swap_write_page (const void *kpage)
 void
 swap_read_page (void *kpage, size_t swap_idx)
 {
-  block_sector_t sector = swap_idx * SECTORS_PER_PG;
-  uint8_t *ofs = (void *) kpage;
-  for (size_t idx = 0; idx < SECTORS_PER_PG; idx++)
-    block_read (swap->block, sector + idx, ofs + idx * BLOCK_SECTOR_SIZE);
+  if (!zswap_load (swap_idx, kpage))
+    {
+      block_sector_t sector = swap_idx * SECTORS_PER_PG;
+      block_read_multiple (swap->block, sector, SECTORS_PER_PG, kpage);
+    }
 
   /* Set bit at SWAP_IDX to 0 to indicate the swap slot is now free. */
   swap_free_slot (swap_idx);
@@ -76,6 +110,7 @@ swap_free_slot (size_t swap_idx)
 {
   ASSERT (bitmap_test (swap->used_map, swap_idx));
 
+  zswap_invalidate (swap_idx);
   lock_acquire (&swap->lock);
   bitmap_set (swap->used_map, swap_idx, false);
   lock_release (&swap->lock);
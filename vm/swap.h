@@ -2,12 +2,24 @@
 #define VM_SWAP_H
 
 #include <stddef.h>
+#include "devices/block.h"
+#include "threads/vaddr.h"
+
+/* Number of sectors that fit into a page. */
+#define SECTORS_PER_PG (PGSIZE / BLOCK_SECTOR_SIZE)
 
 /* Default value that indicates a page is not in swap. */
 #define SWAP_DEFAULT SIZE_MAX
 
+/* Most pages written to consecutive swap slots at once. */
+#define SWAP_CLUSTER 8
+
+/* Most pages read ahead of a page faulted in from swap. */
+#define SWAP_READ_AROUND 4
+
 void swap_table_init (void);
-size_t swap_write_page (const void *kpage);
+void swap_write_pages (const void *const kpages[], size_t cnt,
+                       size_t swap_idx[]);
 void swap_read_page (void *kpage, size_t swap_idx);
 void swap_free_slot (size_t swap_idx);
 
@@ -0,0 +1,419 @@
+#include "vm/zswap.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <string.h>
+#include "vm/swap.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Compressed data is a sequence of tokens. A token byte with
+   the high bit clear is followed by (token + 1) literal bytes.
+   A token byte with the high bit set is followed by a 2-byte
+   little-endian offset, and copies (token & 0x7f) + LZ_MIN_MATCH
+   bytes from that many bytes back in the page. */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 0x7f)
+#define LZ_MAX_LITERALS 0x80
+
+/* Size of the table of earlier positions used to find
+   matches, and the value of an empty table entry. */
+#define LZ_HASH_BITS 10
+#define LZ_NONE UINT16_MAX
+
+/* Page held in the pool. */
+struct zswap_entry
+  {
+    struct hash_elem hash_elem;   /* Element in zswap_table. */
+    struct list_elem lru_elem;    /* Element in zswap_lru. */
+    size_t swap_idx;              /* Swap slot the page belongs to. */
+    uint32_t fill;                /* Word repeated over the page, if
+                                     SIZE is 0. */
+    size_t size;                  /* Bytes of compressed data. */
+    uint8_t data[];               /* Compressed data. */
+  };
+
+/* Largest block that malloc() hands out from an arena page.
+   Larger requests take whole pages of their own. */
+#define MALLOC_MAX_BLOCK (PGSIZE / 4)
+
+/* Largest compressed size of a page that is kept in the pool,
+   so that each entry fits in an arena block. Pages that do not
+   compress at least this well go straight to the swap
+   partition. */
+#define ZSWAP_MAX_SIZE (MALLOC_MAX_BLOCK - sizeof (struct zswap_entry))
+
+/* Most bytes that the pool may take up, or 0 if the pool is
+   disabled. Set at boot time by zswap_configure(). */
+static size_t zswap_max_bytes;
+
+/* Bytes that the pool takes up, as counted by zswap_charge(). */
+static size_t zswap_bytes;
+
+/* Pages in the pool, hashed by swap slot, and least recently
+   stored first. */
+static struct hash zswap_table;
+static struct list zswap_lru;
+
+/* Swap device that pages are spilled to. */
+static struct block *zswap_block;
+
+/* Buffer that pages are compressed into, page that spilled
+   pages are decompressed into, and table of earlier positions
+   used by lz_compress(). */
+static uint8_t *zswap_buffer;
+static uint8_t *zswap_page;
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+/* Protects the fields above. */
+static struct lock zswap_lock;
+
+static struct zswap_entry *zswap_find (size_t swap_idx);
+static void zswap_delete (struct zswap_entry *e);
+static size_t zswap_charge (size_t size);
+static void zswap_spill (void);
+static void zswap_decompress (const struct zswap_entry *e, void *kpage);
+static bool same_filled (const void *kpage, uint32_t *fill);
+static size_t lz_compress (const uint8_t *src, uint8_t *dst, size_t limit);
+static bool lz_emit_literals (const uint8_t *src, size_t cnt,
+                              uint8_t *dst, size_t *op, size_t limit);
+static void lz_decompress (const uint8_t *src, size_t size, uint8_t *dst);
+static hash_hash_func zswap_hash;
+static hash_less_func zswap_less;
+
+/* Lets the compressed pool take up to PAGE_CNT pages of kernel
+   memory. The pool is disabled if PAGE_CNT is 0, which is the
+   default. Must be called before zswap_init(). */
+void
+zswap_configure (size_t page_cnt)
+{
+  zswap_max_bytes = page_cnt * PGSIZE;
+}
+
+/* Initializes the compressed pool, which spills pages to
+   SWAP_BLOCK when it is full. Does nothing if the pool is
+   disabled. */
+void
+zswap_init (struct block *swap_block)
+{
+  if (zswap_max_bytes == 0)
+    return;
+
+  if (!hash_init (&zswap_table, zswap_hash, zswap_less, NULL))
+    PANIC ("zswap_init: failed memory allocation for zswap table.");
+  list_init (&zswap_lru);
+  lock_init (&zswap_lock);
+  zswap_bytes = 0;
+  zswap_block = swap_block;
+
+  zswap_buffer = palloc_get_page (0);
+  zswap_page = palloc_get_page (0);
+  if (zswap_buffer == NULL || zswap_page == NULL)
+    PANIC ("zswap_init: failed memory allocation for zswap buffers.");
+}
+
+/* Compresses the page with kernel virtual address KPAGE into
+   the pool as the contents of swap slot SWAP_IDX, spilling the
+   least recently stored pages to their swap slots on disk if
+   the pool grows too large. Returns true if successful, false
+   if the pool is disabled or the page does not compress well
+   enough, in which case the caller must write the page to
+   the swap slot itself. */
+bool
+zswap_store (size_t swap_idx, const void *kpage)
+{
+  if (zswap_max_bytes == 0)
+    return false;
+
+  lock_acquire (&zswap_lock);
+
+  uint32_t fill = 0;
+  size_t size = 0;
+  if (!same_filled (kpage, &fill))
+    {
+      size = lz_compress (kpage, zswap_buffer, ZSWAP_MAX_SIZE);
+      if (size == 0)
+        {
+          lock_release (&zswap_lock);
+          return false;
+        }
+    }
+
+  struct zswap_entry *e = malloc (sizeof *e + size);
+  if (e == NULL)
+    {
+      lock_release (&zswap_lock);
+      return false;
+    }
+  e->swap_idx = swap_idx;
+  e->fill = fill;
+  e->size = size;
+  memcpy (e->data, zswap_buffer, size);
+  hash_insert (&zswap_table, &e->hash_elem);
+  list_push_back (&zswap_lru, &e->lru_elem);
+  zswap_bytes += zswap_charge (size);
+
+  while (zswap_bytes > zswap_max_bytes)
+    zswap_spill ();
+
+  lock_release (&zswap_lock);
+  return true;
+}
+
+/* If swap slot SWAP_IDX is held in the pool, decompresses it
+   into the page with kernel virtual address KPAGE, drops it
+   from the pool, and returns true. Otherwise, returns false,
+   and the slot must be read from disk. */
+bool
+zswap_load (size_t swap_idx, void *kpage)
+{
+  if (zswap_max_bytes == 0)
+    return false;
+
+  lock_acquire (&zswap_lock);
+  struct zswap_entry *e = zswap_find (swap_idx);
+  if (e != NULL)
+    {
+      zswap_decompress (e, kpage);
+      zswap_delete (e);
+    }
+  lock_release (&zswap_lock);
+
+  return e != NULL;
+}
+
+/* Drops swap slot SWAP_IDX from the pool, if it is held
+   there. Called when the slot is freed. */
+void
+zswap_invalidate (size_t swap_idx)
+{
+  if (zswap_max_bytes == 0)
+    return;
+
+  lock_acquire (&zswap_lock);
+  struct zswap_entry *e = zswap_find (swap_idx);
+  if (e != NULL)
+    zswap_delete (e);
+  lock_release (&zswap_lock);
+}
+
+/* Returns the entry of the pool for swap slot SWAP_IDX, or a
+   null pointer if there is none. zswap_lock must be held. */
+static struct zswap_entry *
+zswap_find (size_t swap_idx)
+{
+  ASSERT (lock_held_by_current_thread (&zswap_lock));
+
+  struct zswap_entry key;
+  struct hash_elem *e;
+
+  key.swap_idx = swap_idx;
+  e = hash_find (&zswap_table, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct zswap_entry, hash_elem) : NULL;
+}
+
+/* Removes E from the pool and frees it. zswap_lock must be
+   held. */
+static void
+zswap_delete (struct zswap_entry *e)
+{
+  ASSERT (lock_held_by_current_thread (&zswap_lock));
+
+  hash_delete (&zswap_table, &e->hash_elem);
+  list_remove (&e->lru_elem);
+  zswap_bytes -= zswap_charge (e->size);
+  free (e);
+}
+
+/* Returns the bytes of kernel memory that an entry with SIZE
+   bytes of compressed data takes up, that is, its share of the
+   malloc() arena page its block comes from. Blocks are powers
+   of 2 of at least 16 bytes, and an arena of B-byte blocks
+   holds PGSIZE / B - 1 of them, the arena header taking up the
+   rest. */
+static size_t
+zswap_charge (size_t size)
+{
+  size_t block_size = 16;
+  while (block_size < sizeof (struct zswap_entry) + size)
+    block_size *= 2;
+  ASSERT (block_size <= MALLOC_MAX_BLOCK);
+  return DIV_ROUND_UP (PGSIZE, PGSIZE / block_size - 1);
+}
+
+/* Writes the least recently stored page in the pool to its
+   swap slot on disk and drops it from the pool. zswap_lock is
+   held during the write, so that a concurrent zswap_load() of
+   the slot falls back to the disk only once the page is
+   there. */
+static void
+zswap_spill (void)
+{
+  ASSERT (lock_held_by_current_thread (&zswap_lock));
+  ASSERT (!list_empty (&zswap_lru));
+
+  struct zswap_entry *e = list_entry (list_front (&zswap_lru),
+                                      struct zswap_entry, lru_elem);
+  zswap_decompress (e, zswap_page);
+  block_write_multiple (zswap_block, e->swap_idx * SECTORS_PER_PG,
+                        SECTORS_PER_PG, zswap_page);
+  zswap_delete (e);
+}
+
+/* Restores the page held in E into the page with kernel
+   virtual address KPAGE. */
+static void
+zswap_decompress (const struct zswap_entry *e, void *kpage)
+{
+  if (e->size == 0)
+    {
+      uint32_t *words = kpage;
+      for (size_t i = 0; i < PGSIZE / sizeof *words; i++)
+        words[i] = e->fill;
+    }
+  else
+    lz_decompress (e->data, e->size, kpage);
+}
+
+/* Returns true if the page with kernel virtual address KPAGE
+   consists of a single 32-bit word repeated, and stores that
+   word in *FILL. Zeroed pages are the common case. */
+static bool
+same_filled (const void *kpage, uint32_t *fill)
+{
+  const uint32_t *words = kpage;
+  for (size_t i = 1; i < PGSIZE / sizeof *words; i++)
+    if (words[i] != words[0])
+      return false;
+
+  *fill = words[0];
+  return true;
+}
+
+/* Compresses the page SRC into DST. Returns the number of
+   bytes written to DST, or 0 if they would exceed LIMIT.
+   Matches are found through a table of the last position at
+   which each hash of 4 bytes was seen, so only the most
+   recent candidate is tried. */
+static size_t
+lz_compress (const uint8_t *src, uint8_t *dst, size_t limit)
+{
+  size_t ip = 0;
+  size_t op = 0;
+  size_t lit = 0;
+
+  memset (lz_table, 0xff, sizeof lz_table);
+  while (ip + LZ_MIN_MATCH <= PGSIZE)
+    {
+      uint32_t word;
+      memcpy (&word, src + ip, sizeof word);
+      unsigned h = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+      size_t ref = lz_table[h];
+      lz_table[h] = ip;
+
+      if (ref == LZ_NONE || memcmp (src + ref, src + ip, LZ_MIN_MATCH))
+        {
+          ip++;
+          continue;
+        }
+
+      /* Extend the match as far as possible. */
+      size_t len = LZ_MIN_MATCH;
+      while (ip + len < PGSIZE && len < LZ_MAX_MATCH
+             && src[ref + len] == src[ip + len])
+        len++;
+
+      if (!lz_emit_literals (src + lit, ip - lit, dst, &op, limit)
+          || op + 3 > limit)
+        return 0;
+      size_t ofs = ip - ref;
+      dst[op++] = 0x80 | (len - LZ_MIN_MATCH);
+      dst[op++] = ofs & 0xff;
+      dst[op++] = ofs >> 8;
+
+      ip += len;
+      lit = ip;
+    }
+
+  if (!lz_emit_literals (src + lit, PGSIZE - lit, dst, &op, limit))
+    return 0;
+  return op;
+}
+
+/* Appends the CNT literal bytes SRC to DST at offset *OP and
+   advances *OP. Returns false if DST would exceed LIMIT
+   bytes. */
+static bool
+lz_emit_literals (const uint8_t *src, size_t cnt,
+                  uint8_t *dst, size_t *op, size_t limit)
+{
+  while (cnt > 0)
+    {
+      size_t n = cnt < LZ_MAX_LITERALS ? cnt : LZ_MAX_LITERALS;
+      if (*op + 1 + n > limit)
+        return false;
+
+      dst[(*op)++] = n - 1;
+      memcpy (dst + *op, src, n);
+      *op += n;
+      src += n;
+      cnt -= n;
+    }
+  return true;
+}
+
+/* Decompresses the SIZE bytes SRC produced by lz_compress()
+   into the page DST. */
+static void
+lz_decompress (const uint8_t *src, size_t size, uint8_t *dst)
+{
+  const uint8_t *end = src + size;
+  uint8_t *op = dst;
+
+  while (src < end)
+    {
+      uint8_t token = *src++;
+      if (token & 0x80)
+        {
+          /* Copy byte by byte, since the match may overlap the
+             bytes being written. */
+          size_t len = (token & 0x7f) + LZ_MIN_MATCH;
+          size_t ofs = src[0] | (src[1] << 8);
+          const uint8_t *ref = op - ofs;
+          src += 2;
+          while (len-- > 0)
+            *op++ = *ref++;
+        }
+      else
+        {
+          size_t len = token + 1;
+          memcpy (op, src, len);
+          op += len;
+          src += len;
+        }
+    }
+
+  ASSERT (op == dst + PGSIZE);
+}
+
+/* Returns a hash of the swap slot of entry E. */
+static unsigned
+zswap_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct zswap_entry *z = hash_entry (e, struct zswap_entry, hash_elem);
+  return hash_int (z->swap_idx);
+}
+
+/* Returns true if entry A precedes entry B. */
+static bool
+zswap_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct zswap_entry *a = hash_entry (a_, struct zswap_entry, hash_elem);
+  const struct zswap_entry *b = hash_entry (b_, struct zswap_entry, hash_elem);
+  return a->swap_idx < b->swap_idx;
+}
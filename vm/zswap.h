@@ -0,0 +1,14 @@
+#ifndef VM_ZSWAP_H
+#define VM_ZSWAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+void zswap_configure (size_t page_cnt);
+void zswap_init (struct block *swap_block);
+bool zswap_store (size_t swap_idx, const void *kpage);
+bool zswap_load (size_t swap_idx, void *kpage);
+void zswap_invalidate (size_t swap_idx);
+
+#endif /* vm/zswap.h */